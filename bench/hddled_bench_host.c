@@ -0,0 +1,194 @@
+/*
+ * Synthetic workloads for the slot logic in hddled_core.h, run in userspace against the
+ * stub backend of host/.
+ *
+ * `make bench-host` builds and runs it. Every workload makes a few million state changes
+ * and reports how many it handled per second and how many of them reached the pads, so
+ * changes to arbitration, patterns, the parser or write_rate can be measured without the
+ * hardware or a kernel. An optional argument sets the number of operations per workload.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hddled_host.h"
+#include "hddled_parse.h"
+
+#define BENCH_HZ    250
+#define BENCH_FILES 4
+
+static unsigned int rng = 1;
+
+// xorshift, cheap enough not to show up in the numbers
+static unsigned int bench_rand(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long ops, double elapsed, const struct hddled_host *host) {
+	printf("%-16s %10lu ops %8.3f s %10.2f Mops/s %10lu pad writes\n",
+	       name, ops, elapsed, ops / elapsed / 1e6, host->pad_writes);
+}
+
+// Single slot writes from userspace, what echo > /dev/hddledN does
+static void bench_user(unsigned long ops) {
+	struct hddled_host host;
+	int states[HDDLED_SLOTS];
+	unsigned long n;
+	double start;
+
+	hddled_host_init(&host, &hddled_stub_backend, 0, BENCH_HZ);
+	start = now();
+	for (n = 0; n < ops; ++n) {
+		unsigned int r = bench_rand();
+
+		memset(states, 0xff, sizeof(states));
+		states[r % HDDLED_SLOTS] = (r >> 8) & 0x3;
+		hddled_host_set_states(&host, states);
+	}
+	report("user", ops, now() - start, &host);
+}
+
+// Every source fighting over the slots: trigger output, userspace, locate and the odd fault
+static void bench_mixed(unsigned long ops) {
+	struct hddled_host host;
+	unsigned long n;
+	double start;
+
+	hddled_host_init(&host, &hddled_stub_backend, 0, BENCH_HZ);
+	start = now();
+	for (n = 0; n < ops; ++n) {
+		unsigned int r = bench_rand(), slot = r % HDDLED_SLOTS, state = (r >> 8) & 0x3;
+
+		switch ((r >> 12) % 16) {
+		case 0:
+			if ((r >> 16) % 64 == 0)
+				hddled_host_set_fault(&host, slot, !host.fault[slot]);
+			break;
+		case 1:
+			hddled_host_set_layer(&host, slot, HDDLED_LAYER_LOCATE, HDDLED_STATE_BOTH,
+					      HDDLED_STATE_BOTH, 2, 250);
+			break;
+		case 2:
+			hddled_host_clear_layer(&host, slot, HDDLED_LAYER_LOCATE);
+			break;
+		case 3:
+		case 4:
+		case 5:
+			hddled_host_set_layer(&host, slot, HDDLED_LAYER_USER, state, 0, 0, 0);
+			break;
+		default:
+			// Activity blinking at a rate that moves with the load
+			hddled_host_set_layer(&host, slot, HDDLED_LAYER_ACTIVITY, HDDLED_STATE_GREEN,
+					      HDDLED_STATE_GREEN, 2, 50 + (r >> 20) % 450);
+			break;
+		}
+	}
+	report("mixed sources", ops, now() - start, &host);
+}
+
+// Every slot running a pattern, one operation is one pattern timer tick
+static void bench_patterns(unsigned long ops) {
+	struct hddled_host host;
+	unsigned long n;
+	double start;
+	int i;
+
+	hddled_host_init(&host, &hddled_stub_backend, 0, BENCH_HZ);
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		hddled_host_set_layer(&host, i, HDDLED_LAYER_USER, HDDLED_STATE_OFF,
+				      0x1b1b1b1b >> (i * 2), HDDLED_PATTERN_MAX_STEPS, 50 * (i + 1));
+	start = now();
+	for (n = 0; n < ops; ++n)
+		hddled_host_tick(&host);
+	report("pattern ticks", ops, now() - start, &host);
+}
+
+// Writers going through write_rate from several open files, single writes and batches,
+// with hddledCoalesceTimer run once per clock tick
+static void bench_limited(unsigned long ops) {
+	struct hddled_bucket buckets[BENCH_FILES];
+	unsigned long n, held = 0, coalesced = 0, dropped = 0;
+	struct hddled_host host;
+	int i, states[HDDLED_SLOTS];
+	double start;
+
+	hddled_host_init(&host, &hddled_stub_backend, 20, BENCH_HZ);
+	for (i = 0; i < BENCH_FILES; ++i)
+		hddled_bucket_init(&buckets[i], host.now, host.hz);
+	start = now();
+	for (n = 0; n < ops; ++n) {
+		unsigned int r = bench_rand(), records = 1 + (r >> 4) % 3;
+
+		memset(states, 0xff, sizeof(states));
+		while (records--) {
+			states[r % HDDLED_SLOTS] = (r >> 8) & 0x3;
+			r = bench_rand();
+		}
+		held += hddled_host_write(&host, &buckets[n % BENCH_FILES], states);
+		// 10 writes per clock tick, far above the limit
+		if (n % 10 == 9) {
+			++host.now;
+			hddled_host_flush(&host);
+		}
+	}
+	report("rate limited", ops, now() - start, &host);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		coalesced += host.limits[i].writes_coalesced;
+		dropped += host.limits[i].writes_dropped;
+	}
+	printf("%-16s %10lu held %10lu coalesced %10lu dropped\n", "", held, coalesced, dropped);
+}
+
+// Batches written to /dev/hddledctl, parsed and applied
+static void bench_parse(unsigned long ops) {
+	static const char * const batches[] = {
+		"1 1\n",
+		"1 1\n2 2\n",
+		"1 0\n2 1\n3 2\n4 3\n5 0\n",
+		"3 2 5 1\n",
+	};
+	size_t len[sizeof(batches) / sizeof(batches[0])];
+	struct hddled_host host;
+	int states[HDDLED_SLOTS];
+	unsigned long n;
+	double start;
+	size_t k;
+
+	for (k = 0; k < sizeof(batches) / sizeof(batches[0]); ++k)
+		len[k] = strlen(batches[k]);
+	hddled_host_init(&host, &hddled_stub_backend, 0, BENCH_HZ);
+	start = now();
+	for (n = 0; n < ops; ++n) {
+		k = n % (sizeof(batches) / sizeof(batches[0]));
+		if (hddled_parse_batch(batches[k], len[k], states) == 0)
+			hddled_host_set_states(&host, states);
+	}
+	report("parse + apply", ops, now() - start, &host);
+}
+
+int main(int argc, char **argv) {
+	unsigned long ops = argc > 1 ? strtoul(argv[1], NULL, 0) : 5000000;
+
+	if (ops == 0) {
+		fprintf(stderr, "usage: %s [operations per workload]\n", argv[0]);
+		return 1;
+	}
+	bench_user(ops);
+	bench_mixed(ops);
+	bench_patterns(ops);
+	bench_limited(ops);
+	bench_parse(ops);
+	return 0;
+}
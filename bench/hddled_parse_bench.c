@@ -0,0 +1,64 @@
+/*
+ * Throughput of the write parsers in hddled_parse.h, in parses per second.
+ *
+ * `make bench-parse` builds and runs it. Each input runs for about a second so results
+ * can be compared between changes to the parser on the same machine.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hddled_parse.h"
+
+static const struct {
+	const char *name;
+	const char *text;
+} inputs[] = {
+	{ "single state", "1\n" },
+	{ "INT_MIN", "-2147483648" },
+	{ "two records", "1 1\n2 2\n" },
+	{ "all slots", "1 0\n2 1\n3 2\n4 3\n5 0\n" },
+	{ "mixed whitespace", "  5\t3  \n\n 1 2 " },
+	{ "rejected record", "1 1\n2 x\n" },
+};
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+	int states[HDDLED_SLOTS], val;
+	volatile int sink = 0;
+	unsigned long n, i;
+	double start, elapsed;
+	size_t k, len;
+
+	printf("%-32s %14s %14s\n", "input", "int/s", "batch/s");
+	for (k = 0; k < sizeof(inputs) / sizeof(inputs[0]); ++k) {
+		double rate[2];
+		int which;
+
+		len = strlen(inputs[k].text);
+		for (which = 0; which < 2; ++which) {
+			n = 0;
+			start = now();
+			do {
+				for (i = 0; i < 100000; ++i) {
+					if (which == 0)
+						sink += hddled_parse_int(inputs[k].text, len, &val);
+					else
+						sink += hddled_parse_batch(inputs[k].text, len, states);
+				}
+				n += i;
+				elapsed = now() - start;
+			} while (elapsed < 1.0);
+			rate[which] = n / elapsed;
+		}
+		printf("%-32s %14.0f %14.0f\n", inputs[k].name, rate[0], rate[1]);
+	}
+	return sink == 1;
+}
@@ -0,0 +1,152 @@
+/*
+ * Fuzz target for hddled_parse.h, the parsers behind writes to /dev/hddledN and
+ * /dev/hddledctl.
+ *
+ * `make fuzz` builds it with libFuzzer. Built with -DHDDLED_FUZZ_STANDALONE (`make fuzz-afl`
+ * and `make fuzz-replay`) it runs every file given on the command line once, or stdin when
+ * there are none, which is what AFL and corpus replays need.
+ *
+ * Every input is checked against a slow reference of the same rules, any mismatch aborts.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hddled_parse.h"
+
+// Same rules as hddled_parse_int in the order kstrtoint applies them: the digit run is
+// scanned first and an overflow in it wins over trailing garbage
+static int ref_parse_int(const char *s, size_t len, int *val) {
+	long long acc = 0;
+	int neg = 0, overflow = 0;
+	size_t i = 0, digits;
+
+	if (len && (s[0] == '+' || s[0] == '-'))
+		neg = s[i++] == '-';
+	for (digits = i; i < len && s[i] >= '0' && s[i] <= '9'; ++i) {
+		acc = acc * 10 + (s[i] - '0');
+		if (acc > (long long)INT_MAX + 1) {
+			overflow = 1;
+			acc = 0;
+		}
+	}
+	if (i == digits)
+		return -EINVAL;
+	if (overflow)
+		return -ERANGE;
+	if (i < len && s[i] == '\n')
+		++i;
+	if (i != len)
+		return -EINVAL;
+	if (neg)
+		acc = -acc;
+	if (acc > INT_MAX || acc < INT_MIN)
+		return -ERANGE;
+	*val = (int)acc;
+	return 0;
+}
+
+static int ref_is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+static int ref_parse_batch(const char *buf, size_t len, int *states) {
+	int i, slot = 0, val, have_slot = 0, records = 0;
+	size_t pos = 0, end;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		states[i] = -1;
+	while (pos < len) {
+		while (pos < len && ref_is_space(buf[pos]))
+			++pos;
+		if (pos == len)
+			break;
+		for (end = pos; end < len && !ref_is_space(buf[end]); ++end)
+			;
+		if (!have_slot) {
+			if (ref_parse_int(buf + pos, end - pos, &slot) < 0 || slot < 1 || slot > HDDLED_SLOTS)
+				return -EINVAL;
+			have_slot = 1;
+		} else {
+			if (ref_parse_int(buf + pos, end - pos, &val) < 0)
+				return -EINVAL;
+			states[slot-1] = val & 0x3;
+			have_slot = 0;
+			++records;
+		}
+		pos = end;
+	}
+	return have_slot || records == 0 ? -EINVAL : 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	const char *buf = (const char *)data;
+	int ret, ref, val = 0, ref_val = 0, i;
+	int states[HDDLED_SLOTS], ref_states[HDDLED_SLOTS];
+
+	ret = hddled_parse_int(buf, size, &val);
+	ref = ref_parse_int(buf, size, &ref_val);
+	if (ret != ref || (ret == 0 && val != ref_val))
+		abort();
+
+	ret = hddled_parse_batch(buf, size, states);
+	ref = ref_parse_batch(buf, size, ref_states);
+	if (ret != ref)
+		abort();
+	if (ret == 0) {
+		for (i = 0; i < HDDLED_SLOTS; ++i) {
+			if (states[i] != ref_states[i] || states[i] < -1 || states[i] > HDDLED_STATE_BOTH)
+				abort();
+		}
+	}
+	return 0;
+}
+
+#ifdef HDDLED_FUZZ_STANDALONE
+static int run_file(FILE *f) {
+	size_t len = 0, cap = 4096, n;
+	uint8_t *data = malloc(cap);
+
+	if (!data)
+		return -1;
+	while ((n = fread(data + len, 1, cap - len, f)) > 0) {
+		len += n;
+		if (len == cap) {
+			uint8_t *grown = realloc(data, cap * 2);
+			if (!grown) {
+				free(data);
+				return -1;
+			}
+			data = grown;
+			cap *= 2;
+		}
+	}
+	LLVMFuzzerTestOneInput(data, len);
+	free(data);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	FILE *f;
+	int i;
+
+	if (argc < 2)
+		return run_file(stdin) < 0;
+	for (i = 1; i < argc; ++i) {
+		f = fopen(argv[i], "rb");
+		if (!f) {
+			perror(argv[i]);
+			return 1;
+		}
+		if (run_file(f) < 0) {
+			fclose(f);
+			return 1;
+		}
+		fclose(f);
+	}
+	printf("%d inputs ok\n", argc - 1);
+	return 0;
+}
+#endif
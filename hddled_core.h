@@ -0,0 +1,299 @@
+/*
+ * Slot logic that does not depend on the kernel: priority layers and their arbitration,
+ * pattern stepping, applying writes to a set of slots and the write_rate token buckets.
+ *
+ * Like hddled_parse.h this is plain C with no locking, timers or pad access, so the module
+ * and the userspace build in host/ share it. Callers serialize access to a slot (the module
+ * holds hddledLock) and pass the clock in, in ticks of hz per second.
+ */
+
+#ifndef HDDLED_CORE_H
+#define HDDLED_CORE_H
+
+#ifndef __KERNEL__
+#include <stdbool.h>
+#endif
+
+#include "hddled_tmj33.h"
+
+#define HDDLED_TICK_MS 50
+
+// Sources that want to drive a slot, a higher layer hides everything below it
+enum hddled_layer {
+	HDDLED_LAYER_NONE     = HDDLED_SOURCE_NONE,     // Nothing active, the slot is off
+	HDDLED_LAYER_ACTIVITY = HDDLED_SOURCE_ACTIVITY, // Output of the slot's trigger
+	HDDLED_LAYER_USER     = HDDLED_SOURCE_USER,     // Writes from userspace and BPF
+	HDDLED_LAYER_LOCATE   = HDDLED_SOURCE_LOCATE,   // locate attribute
+	HDDLED_LAYER_FAULT    = HDDLED_SOURCE_FAULT,    // Latched block error, see fault
+	HDDLED_LAYERS,
+};
+
+struct hddled_layer_state {
+	bool  active;
+	__u8  state;
+	__u8  pattern_len;      // Number of steps, 0 for a static state
+	__u16 pattern_ticks;
+	__u32 pattern;
+};
+
+// Layers of a slot and the fields copied from the one it shows
+struct hddled_core {
+	struct hddled_layer_state layers[HDDLED_LAYERS];
+	enum hddled_layer source; // Layer the slot shows, the fields below are copied from it
+	int   state;            // Static state, shown when no pattern is running
+	__u32 pattern;          // 2 bits per step, step 0 in the low bits
+	__u8  pattern_len;      // Number of steps, 0 when no pattern is running
+	__u8  pattern_pos;
+	__u16 pattern_ticks;    // Timer ticks per step
+	__u16 pattern_count;
+};
+
+// What hddled_core_arbitrate changed
+#define HDDLED_CORE_SOURCE 0x1  // The layer the slot shows
+#define HDDLED_CORE_OUTPUT 0x2  // What the pads should show
+
+// Token bucket for write_rate, holds up to one second worth of writes
+struct hddled_bucket {
+	unsigned long last;     // Clock the tokens were last refilled at
+	unsigned int tokens;
+};
+
+// Rate limit state of a slot
+struct hddled_limit {
+	struct hddled_bucket bucket;
+	int pending;            // Latest rate limited write, -1 for none
+	unsigned long writes_coalesced; // Writes held back by write_rate
+	unsigned long writes_dropped;   // Held back writes replaced by a newer one before they applied
+};
+
+static inline void hddled_core_init(struct hddled_core *core) {
+	*core = (struct hddled_core){ .source = HDDLED_LAYER_USER };
+	core->layers[HDDLED_LAYER_USER].active = true;
+}
+
+static inline void hddled_core_set_layer(struct hddled_core *core, enum hddled_layer layer, int state,
+					 __u32 pattern, unsigned int steps, unsigned int step_ms) {
+	struct hddled_layer_state *l = &core->layers[layer];
+	unsigned int ticks = (step_ms + HDDLED_TICK_MS - 1) / HDDLED_TICK_MS;
+
+	l->active = true;
+	l->state = state & 0x3;
+	l->pattern = steps ? pattern : 0;
+	l->pattern_len = steps;
+	l->pattern_ticks = steps ? (ticks ? ticks : 1) : 0;
+}
+
+// Picks the top active layer and copies it into the fields the renderer and the pattern
+// timer use, a latched fault only takes over the source. Returns HDDLED_CORE_* flags, the
+// output only counts as changed when the shown layer itself changed so sources fighting
+// over lower layers never reach the hardware
+static inline unsigned int hddled_core_arbitrate(struct hddled_core *core, bool fault) {
+	const struct hddled_layer_state *top = &core->layers[HDDLED_LAYER_NONE];
+	enum hddled_layer source = HDDLED_LAYER_NONE;
+	unsigned int changed = 0;
+	int layer;
+
+	for (layer = HDDLED_LAYER_FAULT - 1; layer > HDDLED_LAYER_NONE; --layer) {
+		if (core->layers[layer].active) {
+			top = &core->layers[layer];
+			source = (enum hddled_layer)layer;
+			break;
+		}
+	}
+	if (fault)
+		source = HDDLED_LAYER_FAULT;
+
+	if (core->source != source) {
+		core->source = source;
+		changed |= HDDLED_CORE_SOURCE;
+	}
+	if (core->state == top->state && core->pattern_len == top->pattern_len &&
+	    (!top->pattern_len || (core->pattern == top->pattern && core->pattern_ticks == top->pattern_ticks)))
+		return changed;
+
+	core->state = top->state;
+	core->pattern = top->pattern;
+	core->pattern_len = top->pattern_len;
+	core->pattern_ticks = top->pattern_ticks;
+	core->pattern_pos = 0;
+	core->pattern_count = 0;
+	return changed | HDDLED_CORE_OUTPUT;
+}
+
+// Counts one pattern timer tick, returns true when the pattern moved to its next step
+static inline bool hddled_core_tick(struct hddled_core *core) {
+	if (core->pattern_len == 0 || ++core->pattern_count < core->pattern_ticks)
+		return false;
+	core->pattern_count = 0;
+	core->pattern_pos = (core->pattern_pos + 1) % core->pattern_len;
+	return true;
+}
+
+// The state of the shown layer at the current pattern step
+static inline int hddled_core_output(const struct hddled_core *core) {
+	if (core->pattern_len)
+		return (core->pattern >> (core->pattern_pos * 2)) & 0x3;
+	return core->state;
+}
+
+// How the glue below reaches a caller's slots. The module and host/ keep their slots in
+// different structs and render them differently, everything else is shared
+struct hddled_core_ops {
+	struct hddled_core *(*core)(void *ctx, int slot);
+	bool (*fault)(void *ctx, int slot);     // Whether the slot has a latched fault
+	// Optional, gets the HDDLED_CORE_* flags of every arbitration that changed something
+	void (*changed)(void *ctx, int slot, unsigned int changed);
+	void (*render)(void *ctx, int slot);    // Writes what the slot should show to its pads
+};
+
+// Arbitrates a slot, returns true only when what its pads should show changed. A latched
+// fault is rendered by whoever latched it and needs nothing here
+static inline bool hddled_core_update(const struct hddled_core_ops *ops, void *ctx, int slot) {
+	bool fault = ops->fault(ctx, slot);
+	unsigned int changed = hddled_core_arbitrate(ops->core(ctx, slot), fault);
+
+	if (changed && ops->changed)
+		ops->changed(ctx, slot, changed);
+	return (changed & HDDLED_CORE_OUTPUT) && !fault;
+}
+
+// Sets a layer of a slot, returns true when the slot needs a render
+static inline bool hddled_core_store(const struct hddled_core_ops *ops, void *ctx, int slot,
+				     enum hddled_layer layer, int state, __u32 pattern,
+				     unsigned int steps, unsigned int step_ms) {
+	hddled_core_set_layer(ops->core(ctx, slot), layer, state, pattern, steps, step_ms);
+	return hddled_core_update(ops, ctx, slot);
+}
+
+static inline void hddled_core_clear(const struct hddled_core_ops *ops, void *ctx, int slot,
+				     enum hddled_layer layer) {
+	struct hddled_core *core = ops->core(ctx, slot);
+
+	if (!core->layers[layer].active)
+		return;
+	core->layers[layer].active = false;
+	if (hddled_core_update(ops, ctx, slot))
+		ops->render(ctx, slot);
+}
+
+// Sets the user layer of every slot with states[i] >= 0. The bookkeeping is done first so
+// the pad writes happen back to back and the slots change in the same instant
+static inline void hddled_core_set_states(const struct hddled_core_ops *ops, void *ctx,
+					  const int *states) {
+	bool render[HDDLED_SLOTS] = { false };
+	int i;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (states[i] >= 0)
+			render[i] = hddled_core_store(ops, ctx, i, HDDLED_LAYER_USER, states[i], 0, 0, 0);
+	}
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (render[i])
+			ops->render(ctx, i);
+	}
+}
+
+// Starts empty with the clock one second back, so the first refill fills it
+static inline void hddled_bucket_init(struct hddled_bucket *bucket, unsigned long now, unsigned long hz) {
+	bucket->last = now - hz;
+	bucket->tokens = 0;
+}
+
+// Tops the bucket up for the time since the last refill
+static inline void hddled_bucket_refill(struct hddled_bucket *bucket, unsigned int rate,
+					unsigned long now, unsigned long hz) {
+	unsigned long elapsed = now - bucket->last, added;
+
+	if (elapsed >= hz) {
+		bucket->tokens = rate;
+		bucket->last = now;
+		return;
+	}
+	added = elapsed * rate / hz;
+	if (added) {
+		bucket->tokens = bucket->tokens + added < rate ? bucket->tokens + added : rate;
+		bucket->last += added * hz / rate;
+	}
+}
+
+static inline void hddled_limit_init(struct hddled_limit *limit, unsigned long now, unsigned long hz) {
+	*limit = (struct hddled_limit){ .pending = -1 };
+	hddled_bucket_init(&limit->bucket, now, hz);
+}
+
+// True when every slot with a value in states has a token left
+static inline bool hddled_limit_have_tokens(struct hddled_limit *limits, const int *states,
+					    unsigned int rate, unsigned long now, unsigned long hz) {
+	int i;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (states[i] < 0)
+			continue;
+		hddled_bucket_refill(&limits[i].bucket, rate, now, hz);
+		if (limits[i].bucket.tokens == 0)
+			return false;
+	}
+	return true;
+}
+
+// A write (one slot, or a batch of them) goes through as a unit only when none of its slots
+// has a value held back yet and the writer's bucket and every slot in it have a token left.
+// Otherwise all of states is held back: each slot keeps only its latest value and states is
+// cleared, so a batch is never split. Returns true when the caller has to schedule
+// hddled_limit_flush
+static inline bool hddled_limit_hold(struct hddled_limit *limits, struct hddled_bucket *bucket,
+				     int *states, unsigned int rate, unsigned long now, unsigned long hz) {
+	bool allowed = true;
+	int i;
+
+	if (rate == 0)
+		return false;
+	// Queue behind what is held back for the same slots, so no write overtakes an older one
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (states[i] >= 0 && limits[i].pending >= 0)
+			allowed = false;
+	}
+	hddled_bucket_refill(bucket, rate, now, hz);
+	if (allowed && bucket->tokens && hddled_limit_have_tokens(limits, states, rate, now, hz)) {
+		--bucket->tokens;
+		for (i = 0; i < HDDLED_SLOTS; ++i) {
+			if (states[i] >= 0)
+				--limits[i].bucket.tokens;
+		}
+		return false;
+	}
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (states[i] < 0)
+			continue;
+		if (limits[i].pending >= 0)
+			++limits[i].writes_dropped;
+		++limits[i].writes_coalesced;
+		limits[i].pending = states[i];
+		states[i] = -1;
+	}
+	return true;
+}
+
+// Moves everything held back into states in one batch once every slot in it has a token.
+// Returns false, with nothing taken, when it has to be retried later. A rate of 0 releases
+// everything
+static inline bool hddled_limit_flush(struct hddled_limit *limits, int *states,
+				      unsigned int rate, unsigned long now, unsigned long hz) {
+	int i;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		states[i] = limits[i].pending;
+	if (rate && !hddled_limit_have_tokens(limits, states, rate, now, hz))
+		return false;
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (states[i] < 0)
+			continue;
+		if (rate)
+			--limits[i].bucket.tokens;
+		limits[i].pending = -1;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Parsers for what userspace writes to the char devices.
+ *
+ * Plain C on a pointer and a length with no allocation, locking or kernel helpers, so the
+ * same code builds into the module and into a userspace program (e.g. a fuzzer) that
+ * includes this header. Nothing here needs the input to be NUL terminated.
+ */
+
+#ifndef HDDLED_PARSE_H
+#define HDDLED_PARSE_H
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/limits.h>
+#include <linux/types.h>
+#else
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#endif
+
+#include "hddled_tmj33.h"
+
+static inline bool hddled_parse_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+// Same rules as kstrtoint in base 10: an optional sign, at least one digit and at most a
+// single trailing newline
+static inline int hddled_parse_int(const char *s, size_t len, int *val) {
+	unsigned int limit = INT_MAX, acc = 0;
+	bool neg = false;
+	size_t i = 0;
+
+	if (len && s[len-1] == '\n')
+		--len;
+	if (len && (s[0] == '+' || s[0] == '-')) {
+		neg = s[0] == '-';
+		limit = neg ? (unsigned int)INT_MAX + 1 : INT_MAX;
+		++i;
+	}
+	if (i == len)
+		return -EINVAL;
+
+	for (; i < len; ++i) {
+		if (s[i] < '0' || s[i] > '9')
+			return -EINVAL;
+		if (acc > (limit - (s[i] - '0')) / 10)
+			return -ERANGE;
+		acc = acc * 10 + (s[i] - '0');
+	}
+
+	*val = neg ? (int)(0U - acc) : (int)acc;
+	return 0;
+}
+
+// Parses whitespace separated "<slot> <state>" records into states (-1 for untouched slots)
+static inline int hddled_parse_batch(const char *buf, size_t len, int *states) {
+	int i, slot = 0, val, records = 0;
+	bool have_slot = false;
+	size_t pos = 0, tok;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		states[i] = -1;
+
+	while (pos < len) {
+		if (hddled_parse_space(buf[pos])) {
+			++pos;
+			continue;
+		}
+		for (tok = pos; pos < len && !hddled_parse_space(buf[pos]); ++pos)
+			;
+		if (!have_slot) {
+			if (hddled_parse_int(buf + tok, pos - tok, &slot) < 0 || slot < 1 || slot > HDDLED_SLOTS)
+				return -EINVAL;
+			have_slot = true;
+			continue;
+		}
+		if (hddled_parse_int(buf + tok, pos - tok, &val) < 0)
+			return -EINVAL;
+		states[slot-1] = val & 0x3;
+		have_slot = false;
+		++records;
+	}
+
+	if (have_slot || records == 0)
+		return -EINVAL;
+	return 0;
+}
+
+#endif
@@ -49,6 +49,16 @@
  * 3 - BOTH (orange)
  *
  * `echo 1 > /dev/hddled1`
+ *
+ * It also creates a control device /dev/hddledctl that accepts "<slot> <state>" records
+ * (slot is the N in /dev/hddledN) and applies all of them at once, or none if any record
+ * is malformed. Each iovec of a writev is treated as a separate record. Reading it returns
+ * one "<state>\n" line per slot, so a readv can scatter the slots into separate buffers.
+ *
+ * `printf '1 1\n2 2\n' > /dev/hddledctl`
+ *
+ * /dev/hddledstat is read only and returns a struct hddled_stat (see hddled_tmj33.h) with
+ * the state, source and change counters of every slot, taken as one consistent snapshot.
  */
 
 #include <linux/init.h>           // Macros used to mark up functions e.g. __init __exit
@@ -59,6 +69,40 @@
 #include <linux/uaccess.h>        // Required for the copy to user function
 #include <linux/slab.h>           // For kmalloc/kfree
 #include <linux/io.h>             // Added because the module would not compile under Kernel 5.6 without it
+#include <linux/uio.h>            // For iov_iter used by read_iter/write_iter
+#include <linux/spinlock.h>       // For serializing updates across slots
+#include <linux/timer.h>          // For stepping LED patterns
+#include <linux/io_uring/cmd.h>   // For uring_cmd passthrough
+#include <linux/irq_work.h>       // For applying state posted from BPF programs
+#include <linux/btf.h>            // For registering the BPF kfuncs
+#include <linux/btf_ids.h>
+#include <linux/workqueue.h>      // For sending netlink notifications outside of atomic context
+#include <net/genetlink.h>        // For the generic netlink family
+#include <linux/blkdev.h>         // For binding slots to disks
+#include <linux/part_stat.h>      // For sampling disk I/O counters
+#include <linux/average.h>        // For the EWMA of disk I/O
+#include <linux/mutex.h>
+#include <linux/blk-mq.h>         // For struct request in the error tracepoint
+#include <linux/tracepoint.h>     // For latching slots on block errors
+#include <linux/rcupdate.h>
+#include <linux/namei.h>          // For reading md state from sysfs
+#include <linux/ctype.h>
+#include <linux/dmi.h>            // For picking the bay to port table of the board
+#include <linux/pci.h>
+#include <linux/libata.h>         // For resolving bays to ports of the AHCI controller
+#include <scsi/scsi_device.h>
+#include <scsi/scsi_host.h>
+#include <linux/panic_notifier.h> // For lighting the bays on panic
+#include <linux/kdebug.h>         // For lighting the bays on oops
+#include <linux/sched/loadavg.h>  // For scaling the heartbeat with load
+#include <linux/pm_runtime.h>     // For stopping the timers while every slot is static
+#include <linux/seqlock.h>        // For publishing /dev/hddledstat without a lock
+#include <linux/timekeeping.h>
+#include <linux/mm.h>             // For mapping the status page
+
+#include "hddled_tmj33.h"
+#include "hddled_parse.h"
+#include "hddled_core.h"
 
 #ifndef HDDLED_TMJ33_VERSION
 #define HDDLED_TMJ33_VERSION "0.3"
@@ -67,39 +111,386 @@
 #define DEVICE_NAME "hddled"
 #define CLASS_NAME  "hddled"
 
+#define HDDLED_CTL_MINOR HDDLED_SLOTS
+#define HDDLED_STAT_MINOR (HDDLED_SLOTS + 1)
+#define HDDLED_CTL_BUF   256
+#define HDDLED_SAMPLE_MS 250
+
+// Activity blinking runs between these step lengths, faster with more I/O
+#define HDDLED_ACTIVITY_SLOW_MS 500
+#define HDDLED_ACTIVITY_FAST_MS 50
+// Permille of the sample time the disk was busy before it counts as saturated
+#define HDDLED_ACTIVITY_SATURATED 900
+
+#define HDDLED_FAULT_BLINK_MS 500
+#define HDDLED_LOCATE_MS      250
+#define HDDLED_STANDBY_CHECK_MS 1000
+
+// Rebuild blinking runs between these step lengths, faster as recovery progresses
+#define HDDLED_MD_SLOW_MS  1000
+#define HDDLED_MD_FAST_MS  100
+#define HDDLED_MD_MEMBERS  16
+
+// Temperature reads a disk without I/O may skip before it is read anyway
+#define HDDLED_TEMP_MAX_SKIPS 10
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Arnar Gauti Ingason");
 MODULE_DESCRIPTION("A char driver for controlling HDD LEDs on Terramaster devices based on J33xx");
 MODULE_VERSION(HDDLED_TMJ33_VERSION);
 
+static unsigned int activity_heavy = 51200;
+module_param(activity_heavy, uint, 0644);
+MODULE_PARM_DESC(activity_heavy, "Throughput in KiB/s at which the activity trigger shows a disk as heavily loaded");
+
+static bool fault_latch = true;
+module_param(fault_latch, bool, 0444);
+MODULE_PARM_DESC(fault_latch, "Latch a slot red when a request to its disk fails, until 0 is written to its fault attribute");
+
+static bool fault_blink = false;
+module_param(fault_blink, bool, 0644);
+MODULE_PARM_DESC(fault_blink, "Blink latched slots red instead of keeping them solid red");
+
+static char *md_arrays = "md0";
+module_param(md_arrays, charp, 0444);
+MODULE_PARM_DESC(md_arrays, "Comma separated md arrays followed by the md trigger");
+
+static unsigned int md_interval = 2000;
+module_param(md_interval, uint, 0644);
+MODULE_PARM_DESC(md_interval, "Milliseconds between samples of md array state");
+
+static unsigned int temp_interval = 60;
+module_param(temp_interval, uint, 0644);
+MODULE_PARM_DESC(temp_interval, "Seconds between drive temperature reads of the temp trigger");
+
+static unsigned int standby_led = HDDLED_STATE_OFF;
+module_param(standby_led, uint, 0644);
+MODULE_PARM_DESC(standby_led, "State (0-3) shown by slots whose disk is in standby");
+
+static bool adopt = false;
+module_param(adopt, bool, 0444);
+MODULE_PARM_DESC(adopt, "Take over the current LED state at load instead of turning every LED off");
+
+static bool clear_on_exit = false;
+module_param(clear_on_exit, bool, 0644);
+MODULE_PARM_DESC(clear_on_exit, "Turn every LED off at unload instead of leaving them as they are");
+
+static bool boot_anim = false;
+module_param(boot_anim, bool, 0444);
+MODULE_PARM_DESC(boot_anim, "Run a boot animation from load until userspace first writes a slot or writes boot_done");
+
+static bool panic_leds = true;
+module_param(panic_leds, bool, 0444);
+MODULE_PARM_DESC(panic_leds, "Turn every slot red on kernel panic and orange on oops");
+
+static bool autobind = true;
+module_param(autobind, bool, 0444);
+MODULE_PARM_DESC(autobind, "Bind slots to the disks on their ports of the onboard AHCI controller and follow hotplug");
+
+static bool skip_empty = true;
+module_param(skip_empty, bool, 0444);
+MODULE_PARM_DESC(skip_empty, "Hold slots without a disk off and skip them in all periodic work (needs autobind)");
+
+static int ports[HDDLED_SLOTS];
+static int nr_ports;
+module_param_array(ports, int, &nr_ports, 0444);
+MODULE_PARM_DESC(ports, "AHCI port number of each slot (-1 for none), overrides the built in board table");
+
+static unsigned int write_rate = 0;
+module_param(write_rate, uint, 0644);
+MODULE_PARM_DESC(write_rate, "Writes per second each open file and each slot may make, extra writes are coalesced into the latest value (0 for no limit)");
+
+static bool sim = false;
+module_param(sim, bool, 0444);
+MODULE_PARM_DESC(sim, "Keep the LED states in memory instead of touching the hardware, for testing on any machine");
+
+DECLARE_EWMA(hddled_io, 4, 8)
+
+enum hddled_trigger {
+	HDDLED_TRIGGER_NONE,
+	HDDLED_TRIGGER_ACTIVITY,
+	HDDLED_TRIGGER_MD,
+	HDDLED_TRIGGER_TEMP,
+	HDDLED_TRIGGER_HEARTBEAT,
+};
+
+static const char * const hddled_trigger_names[] = {
+	[HDDLED_TRIGGER_NONE]     = "none",
+	[HDDLED_TRIGGER_ACTIVITY] = "activity",
+	[HDDLED_TRIGGER_MD]       = "md",
+	[HDDLED_TRIGGER_TEMP]     = "temp",
+	[HDDLED_TRIGGER_HEARTBEAT] = "heartbeat",
+};
+
 struct hddled {
+	// Pads of the slot, only touched by the register backend
 	volatile unsigned int *green;
 	volatile unsigned int *red;
+	int index;              // Slot number - 1
+	struct hddled_core core; // Layers and the state they resolve to, see hddled_core.h
+	struct file *bdev_file; // Disk bound to the slot, NULL when unbound
+	struct gendisk __rcu *disk; // Same disk, for lookups from the error tracepoint
+	bool fault;             // Latched by a block error until cleared in sysfs, overrides everything
+	bool empty;             // No disk in the bay, held off and skipped by periodic work
+	bool standby;           // Disk idle past standby_timeout, dimmed and skipped by periodic work
+	unsigned int standby_timeout; // Seconds without I/O before the disk counts as in standby, 0 never
+	unsigned long standby_ios;    // Disk I/O count at the last standby check
+	unsigned long last_io;        // Jiffies when I/O was last seen
+	enum hddled_trigger trigger;
+	unsigned long last_sectors;
+	unsigned long last_io_ticks;
+	struct ewma_hddled_io rate;  // KiB/s
+	struct ewma_hddled_io util;  // Permille of time the disk was busy
+	int temp;               // Last drive temperature in millidegrees Celsius
+	int temp_warn;          // Degrees Celsius at which the slot turns orange
+	int temp_crit;          // Degrees Celsius at which the slot turns red
+	int temp_hyst;          // Degrees Celsius to cool below a threshold before stepping back
+	int temp_level;         // 0 normal, 1 warn, 2 crit
+	unsigned long temp_ios; // Disk I/O count at the last temperature read
+	unsigned int temp_skips; // Reads skipped in a row because the disk had no I/O
+};
+
+// AHCI port number of each bay, -1 where a board has no bay
+struct hddled_board {
+	const char *product;
+	int ports[HDDLED_SLOTS];
+};
+
+static const struct hddled_board hddled_boards[] = {
+	{ "F2-221", { 0, 1, -1, -1, -1 } },
+	{ "F5-221", { 0, 1, 2, 3, 4 } },
+};
+
+// Built in animations, the frame tables are computed at compile time
+#define HDDLED_FRAME(s1, s2, s3, s4, s5, _ms) \
+	{ .states = (s1) | (s2) << 2 | (s3) << 4 | (s4) << 6 | (s5) << 8, .ms = (_ms) }
+#define G HDDLED_STATE_GREEN
+#define O HDDLED_STATE_BOTH
+#define R HDDLED_STATE_RED
+
+static const struct hddled_anim_frame hddled_anim_chase[] = {
+	HDDLED_FRAME(G, 0, 0, 0, 0, 120),
+	HDDLED_FRAME(0, G, 0, 0, 0, 120),
+	HDDLED_FRAME(0, 0, G, 0, 0, 120),
+	HDDLED_FRAME(0, 0, 0, G, 0, 120),
+	HDDLED_FRAME(0, 0, 0, 0, G, 120),
+	HDDLED_FRAME(0, 0, 0, G, 0, 120),
+	HDDLED_FRAME(0, 0, G, 0, 0, 120),
+	HDDLED_FRAME(0, G, 0, 0, 0, 120),
+};
+
+static const struct hddled_anim_frame hddled_anim_sweep[] = {
+	HDDLED_FRAME(O, 0, 0, 0, 0, 100),
+	HDDLED_FRAME(O, O, 0, 0, 0, 100),
+	HDDLED_FRAME(O, O, O, 0, 0, 100),
+	HDDLED_FRAME(O, O, O, O, 0, 100),
+	HDDLED_FRAME(O, O, O, O, O, 300),
+	HDDLED_FRAME(0, O, O, O, O, 100),
+	HDDLED_FRAME(0, 0, O, O, O, 100),
+	HDDLED_FRAME(0, 0, 0, O, O, 100),
+	HDDLED_FRAME(0, 0, 0, 0, O, 100),
+	HDDLED_FRAME(0, 0, 0, 0, 0, 300),
+};
+
+static const struct hddled_anim_frame hddled_anim_identify[] = {
+	HDDLED_FRAME(R, R, R, R, R, 250),
+	HDDLED_FRAME(0, 0, 0, 0, 0, 250),
+	HDDLED_FRAME(G, G, G, G, G, 250),
+	HDDLED_FRAME(0, 0, 0, 0, 0, 250),
+};
+
+#undef G
+#undef O
+#undef R
+
+static const struct hddled_anim_frame hddled_anim_boot[] = {
+	HDDLED_FRAME(G, 0, 0, 0, 0, 200),
+	HDDLED_FRAME(G, G, 0, 0, 0, 200),
+	HDDLED_FRAME(G, G, G, 0, 0, 200),
+	HDDLED_FRAME(G, G, G, G, 0, 200),
+	HDDLED_FRAME(G, G, G, G, G, 400),
+	HDDLED_FRAME(0, 0, 0, 0, 0, 400),
+};
+
+static const char * const hddled_anim_names[] = {
+	[HDDLED_ANIM_NONE]     = "none",
+	[HDDLED_ANIM_CHASE]    = "chase",
+	[HDDLED_ANIM_SWEEP]    = "sweep",
+	[HDDLED_ANIM_IDENTIFY] = "identify",
+	[HDDLED_ANIM_CUSTOM]   = "custom",
+	[HDDLED_ANIM_BOOT]     = "boot",
 };
 
 struct private_data {
 	bool read_done;
+	struct hddled_bucket bucket;
+	// Staged transaction on /dev/hddledctl
+	struct mutex txn_lock;
+	bool txn_open;
+	int txn[HDDLED_SLOTS];
 };
 
 static int    majorNumber;
 static struct class  *hddledClass = NULL;
-static struct device *hddledDevices[5] = { NULL };
-static struct hddled *hddleds[5] = { NULL };
+static struct device *hddledDevices[HDDLED_SLOTS] = { NULL };
+static struct device *hddledCtlDevice = NULL;
+static struct device *hddledStatDevice = NULL;
+static struct hddled *hddleds[HDDLED_SLOTS] = { NULL };
+
+// Serializes pad updates so a batch is never interleaved with another writer
+static DEFINE_SPINLOCK(hddledLock);
+// Published for /dev/hddledstat on every change, readers retry instead of taking hddledLock
+static struct hddled_stat hddledStat = {
+	.version = HDDLED_STAT_VERSION,
+	.size    = sizeof(struct hddled_stat),
+};
+static seqcount_spinlock_t hddledStatSeq = SEQCNT_SPINLOCK_ZERO(hddledStatSeq, &hddledLock);
+// Copy of hddledStat that pollers mmap from /dev/hddledstat
+static struct hddled_stat_page *hddledStatPage = NULL;
+// State posted from BPF: 2 bits per slot with slot 1 in the low bits, plus a pending bit per slot
+#define HDDLED_DESIRED_PENDING(i)   BIT(16 + (i))
+#define HDDLED_DESIRED_PENDING_MASK GENMASK(16 + HDDLED_SLOTS - 1, 16)
+static atomic_t hddledDesired = ATOMIC_INIT(0);
+static struct irq_work hddledDesiredWork;
+// Slots latched by the error tracepoint, applied from hddledFaultWork
+static atomic_t hddledFault = ATOMIC_INIT(0);
+static struct irq_work hddledFaultWork;
+static struct tracepoint *hddledRqErrorTp = NULL;
+static bool hddledRqErrorRegistered = false;
+// Slots that changed since the last netlink notification
+static atomic_t hddledChanged = ATOMIC_INIT(0);
+static struct work_struct hddledNotifyWork;
+// Cleared at exit before the family is unregistered, hddled_notify does nothing after that
+static bool hddledGenlRegistered = false;
+// Single timer stepping the patterns of all slots, only armed while a pattern runs
+static struct timer_list hddledPatternTimer;
+// Single timer sampling the disks of all triggered slots, only armed while one is bound
+static struct timer_list hddledSampleTimer;
+static unsigned long hddledLastSample;
+// Single low frequency work sampling md array state, only queued while a slot follows md
+static struct delayed_work hddledMdWork;
+// Single slow deferrable work reading drive temperatures, only queued while a slot follows temp
+static struct delayed_work hddledTempWork;
+// Serializes binding and unbinding disks, which may sleep
+static DEFINE_MUTEX(hddledBindLock);
+// AHCI port of each slot, resolved once at init
+static int hddledPorts[HDDLED_SLOTS];
+// Ports that came from ports= or the board table, only those bays can be told to be empty
+static bool hddledPortsKnown[HDDLED_SLOTS];
+// Single deferrable timer pulsing every heartbeat slot in the same phase
+static struct timer_list hddledHeartbeatTimer;
+static unsigned int hddledHeartbeatPhase;
+static bool hddledHeartbeatOn;
+// Set once the panic or die notifier took over the pads, nothing else writes them after that
+static bool hddledPanicked = false;
+// Running enclosure animation, it owns the pads of every slot while set
+static struct timer_list hddledAnimTimer;
+static unsigned int hddledAnim = HDDLED_ANIM_NONE;
+static const struct hddled_anim_frame *hddledAnimFrames;
+static unsigned int hddledAnimCount;
+static unsigned int hddledAnimPos;
+static struct hddled_anim_frame hddledCustomFrames[HDDLED_ANIM_MAX_FRAMES];
+// Boot animation runs until userspace takes over
+static bool hddledBooting = false;
+static unsigned int hddledCustomCount;
+// Single deferrable timer tracking idle time of slots with a standby timeout
+static struct timer_list hddledStandbyTimer;
+// Rebinds slots from the port topology, queued on SCSI hotplug
+static struct work_struct hddledRescanWork;
+static bool hddledScsiNotifier = false;
+// Single timer applying writes held back by write_rate, only armed while one is pending
+static struct timer_list hddledCoalesceTimer;
+// write_rate state of each slot, held back writes are applied by hddledCoalesceTimer
+static struct hddled_limit hddledLimits[HDDLED_SLOTS];
+// What the pads showed when the system went to sleep, written back on resume
+static int hddledSuspendStates[HDDLED_SLOTS];
+
+// Declared in the private SCSI headers but exported for modules
+extern const struct bus_type scsi_bus_type;
 
 
 static int     dev_open(struct inode*, struct file*);
 static int     dev_release(struct inode*, struct file*);
-static ssize_t dev_read(struct file*, char*, size_t, loff_t*);
-static ssize_t dev_write(struct file*, const char*, size_t, loff_t*);
+static ssize_t dev_read_iter(struct kiocb*, struct iov_iter*);
+static ssize_t dev_write_iter(struct kiocb*, struct iov_iter*);
+static int     dev_uring_cmd(struct io_uring_cmd*, unsigned int);
+static long    dev_ioctl(struct file*, unsigned int, unsigned long);
+static int     dev_mmap(struct file*, struct vm_area_struct*);
+
+static struct hddled* create_hddled(int);
+static int  hddled_get_state(struct hddled*);
+static void hddled_write_pads(struct hddled*, int);
+static void hddled_write_pads_raw(struct hddled*, int);
+static void hddled_publish(struct hddled*, int);
+static int  hddled_start_anim(unsigned int);
+static void hddled_idle(void);
+static void hddled_pattern_tick(struct timer_list*);
+static void hddled_apply_desired(struct irq_work*);
+static void hddled_notify(struct work_struct*);
+static void hddled_sample_tick(struct timer_list*);
+static void hddled_apply_faults(struct irq_work*);
+static void hddled_md_work(struct work_struct*);
+static void hddled_temp_work(struct work_struct*);
+static void hddled_standby_tick(struct timer_list*);
+static void hddled_anim_tick(struct timer_list*);
+static void hddled_heartbeat_tick(struct timer_list*);
+static void hddled_coalesce_tick(struct timer_list*);
+static int  hddled_panic_event(struct notifier_block*, unsigned long, void*);
+static int  hddled_die_event(struct notifier_block*, unsigned long, void*);
+
+static struct notifier_block hddledPanicNb = {
+	.notifier_call = hddled_panic_event,
+	.priority      = INT_MAX,
+};
+
+static struct notifier_block hddledDieNb = {
+	.notifier_call = hddled_die_event,
+	.priority      = INT_MAX,
+};
+static void hddled_rescan(struct work_struct*);
+static int  hddled_scsi_event(struct notifier_block*, unsigned long, void*);
+
+static struct notifier_block hddledScsiNb = {
+	.notifier_call = hddled_scsi_event,
+};
+static int  hddled_suspend(struct device*);
+static int  hddled_resume(struct device*);
+static int  hddled_runtime_suspend(struct device*);
+static int  hddled_runtime_resume(struct device*);
 
-static struct hddled* create_hddled(unsigned int);
+// Set on the class, so every node gets it but only hddledctl acts on it
+static const struct dev_pm_ops hddled_pm_ops = {
+	SYSTEM_SLEEP_PM_OPS(hddled_suspend, hddled_resume)
+	RUNTIME_PM_OPS(hddled_runtime_suspend, hddled_runtime_resume, NULL)
+};
+static void hddled_rq_error(void*, struct request*, blk_status_t, unsigned int);
+static void hddled_set_pattern(struct hddled*, u32, unsigned int, unsigned int);
+static int  hddled_bind(struct hddled*, const char*);
+
+static const struct attribute_group hddled_group;
+static const struct attribute_group *hddled_groups[] = {
+	&hddled_group,
+	NULL
+};
+
+static const struct attribute_group hddled_ctl_group;
+static const struct attribute_group *hddled_ctl_groups[] = {
+	&hddled_ctl_group,
+	NULL
+};
+
+static struct genl_family hddled_genl_family;
 
 static struct file_operations fops = {
-	.owner   = THIS_MODULE,
-	.open    = dev_open,
-	.read    = dev_read,
-	.write   = dev_write,
-	.release = dev_release
+	.owner      = THIS_MODULE,
+	.open       = dev_open,
+	.read_iter  = dev_read_iter,
+	.write_iter = dev_write_iter,
+	.uring_cmd  = dev_uring_cmd,
+	.unlocked_ioctl = dev_ioctl,
+	.compat_ioctl   = compat_ptr_ioctl,
+	.mmap       = dev_mmap,
+	.release    = dev_release
 };
 
 // Copied from Terramaster module
@@ -116,12 +507,182 @@ static unsigned  int read_base(unsigned char offset) {
         return val&0xfffff000;
 }
 
+/*
+ * Register backend. Everything that touches the hardware goes through one of these, the
+ * rest of the module only deals in HDDLED_STATE_* values. set and get are called with
+ * hddledLock held and set also from panic and NMI context, so neither may sleep or lock.
+ */
+struct hddled_backend {
+	const char *name;
+	void (*probe)(void);
+	int  (*map)(struct hddled *led);
+	void (*unmap)(struct hddled *led);
+	int  (*get)(struct hddled *led);
+	void (*set)(struct hddled *led, int val);
+};
+
+static unsigned int hddledGpioBase;
+
+static void hddled_gpio_probe(void) {
+	hddledGpioBase = read_base(0x10);
+}
+
+// Green pads are 0x8 apart from base+0xC505B8, red pads are 0x28 above the green one
+static int hddled_gpio_map(struct hddled *led) {
+	unsigned int addr = hddledGpioBase + 0xC505B8 + led->index * 0x8;
+
+	led->green = (volatile unsigned int *)ioremap(addr, 1);
+	led->red = (volatile unsigned int *)ioremap(addr+0x28, 1);
+	if (!led->green || !led->red)
+		return -ENOMEM;
+	return 0;
+}
+
+static void hddled_gpio_unmap(struct hddled *led) {
+	// iounmap red and green led address in each hddled
+	if (led->green)
+		iounmap(led->green);
+	if (led->red)
+		iounmap(led->red);
+}
+
+static int hddled_gpio_get(struct hddled *led) {
+	return ((*led->green & 0x1) ^ 0x1) | ((*led->red & 0x1) << 1);
+}
+
+static void hddled_gpio_set(struct hddled *led, int val) {
+	// Green LED
+	if (val & 0x1) {
+		// Turning on
+		*led->green &= 0xfffffffe;
+	} else {
+		// Turning off
+		*led->green |= 0x1;
+	}
+
+	// Red LED
+	if (((val >> 1) & 0x1)) {
+		// Turning on
+		*led->red |= 0x1;
+	} else {
+		// Turning off
+		*led->red &= 0xfffffffe;
+	}
+}
+
+static const struct hddled_backend hddled_gpio_backend = {
+	.name  = "gpio",
+	.probe = hddled_gpio_probe,
+	.map   = hddled_gpio_map,
+	.unmap = hddled_gpio_unmap,
+	.get   = hddled_gpio_get,
+	.set   = hddled_gpio_set,
+};
+
+// Simulated pads for sim=1, every interface behaves the same but nothing reaches the hardware
+static int hddledSimPads[HDDLED_SLOTS];
+
+static void hddled_sim_probe(void) {
+}
+
+static int hddled_sim_map(struct hddled *led) {
+	WRITE_ONCE(hddledSimPads[led->index], HDDLED_STATE_OFF);
+	return 0;
+}
+
+static void hddled_sim_unmap(struct hddled *led) {
+}
+
+static int hddled_sim_get(struct hddled *led) {
+	return READ_ONCE(hddledSimPads[led->index]);
+}
+
+static void hddled_sim_set(struct hddled *led, int val) {
+	WRITE_ONCE(hddledSimPads[led->index], val & 0x3);
+}
+
+static const struct hddled_backend hddled_sim_backend = {
+	.name  = "sim",
+	.probe = hddled_sim_probe,
+	.map   = hddled_sim_map,
+	.unmap = hddled_sim_unmap,
+	.get   = hddled_sim_get,
+	.set   = hddled_sim_set,
+};
+
+static const struct hddled_backend *hddledBackend = &hddled_gpio_backend;
+
+__bpf_kfunc_start_defs();
+
+// Safe from any context: only the desired state word is touched here, the pads are
+// written later from hddled_apply_desired
+__bpf_kfunc int bpf_hddled_set(u32 slot, u32 state) {
+	int old, new;
+
+	if (slot < 1 || slot > HDDLED_SLOTS || state > HDDLED_STATE_BOTH)
+		return -EINVAL;
+
+	old = atomic_read(&hddledDesired);
+	do {
+		new = old & ~(0x3 << ((slot-1) * 2));
+		new |= (state << ((slot-1) * 2)) | HDDLED_DESIRED_PENDING(slot-1);
+	} while (!atomic_try_cmpxchg(&hddledDesired, &old, new));
+
+	// Anything already pending has the applier queued
+	if (!(old & HDDLED_DESIRED_PENDING_MASK))
+		irq_work_queue(&hddledDesiredWork);
+	return 0;
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(hddled_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_hddled_set)
+BTF_KFUNCS_END(hddled_kfunc_ids)
+
+static const struct btf_kfunc_id_set hddled_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set   = &hddled_kfunc_ids,
+};
+
+static void hddled_find_tracepoint(struct tracepoint *tp, void *priv) {
+	if (!strcmp(tp->name, "block_rq_error"))
+		hddledRqErrorTp = tp;
+}
+
+static void hddled_resolve_ports(void) {
+	const struct hddled_board *board = NULL;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hddled_boards); ++i) {
+		if (dmi_match(DMI_PRODUCT_NAME, hddled_boards[i].product)) {
+			board = &hddled_boards[i];
+			break;
+		}
+	}
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		hddledPortsKnown[i] = i < nr_ports || board;
+		if (i < nr_ports)
+			hddledPorts[i] = ports[i];
+		else if (board)
+			hddledPorts[i] = board->ports[i];
+		else
+			hddledPorts[i] = i;
+	}
+}
+
 static int __init hddled_init(void) {
-	int i, offset;
-	unsigned int base = read_base(0x10);
+	int i, err;
+	unsigned long flags;
+
+	hddledStatPage = (struct hddled_stat_page *)get_zeroed_page(GFP_KERNEL);
+	if (!hddledStatPage)
+		return -ENOMEM;
 
 	majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
 	if (majorNumber < 0) {
+		free_page((unsigned long)hddledStatPage);
 		printk(KERN_ALERT "HDDLed failed to register a major number\n");
 		return majorNumber;
 	}
@@ -130,23 +691,119 @@ static int __init hddled_init(void) {
 	hddledClass = class_create(CLASS_NAME);
 	if (IS_ERR(hddledClass)) {
 		unregister_chrdev(majorNumber, "hddled");
+		free_page((unsigned long)hddledStatPage);
 		printk(KERN_ALERT "Failed to register device class\n");
 		return PTR_ERR(hddledClass);
 	}
+	hddledClass->pm = &hddled_pm_ops;
 	printk(KERN_INFO "HDDLed: device class registered correctly\n");
 
-	// Create char devices
+	// Create hddled iomaps
+	if (sim)
+		hddledBackend = &hddled_sim_backend;
+	hddledBackend->probe();
+	printk(KERN_INFO "HDDLed: using the %s backend\n", hddledBackend->name);
+	for (i = 0; i < sizeof(hddleds)/sizeof(struct hddled*); ++i) {
+		hddleds[i] = create_hddled(i);
+		if (!hddleds[i]) {
+			printk(KERN_ALERT "HDDLed: failed to map the pads of slot %d\n", i+1);
+			while (i-- > 0) {
+				hddledBackend->unmap(hddleds[i]);
+				kfree(hddleds[i]);
+				hddleds[i] = NULL;
+			}
+			class_destroy(hddledClass);
+			unregister_chrdev(majorNumber, "hddled");
+			free_page((unsigned long)hddledStatPage);
+			return -ENOMEM;
+		}
+		hddledStat.slots[i].source = hddleds[i]->core.source;
+		if (adopt) {
+			// Keep whatever firmware or the previous instance left on the pads
+			hddleds[i]->core.state = hddled_get_state(hddleds[i]);
+			hddleds[i]->core.layers[HDDLED_LAYER_USER].state = hddleds[i]->core.state;
+			hddledStat.slots[i].state = hddleds[i]->core.state;
+			continue;
+		}
+		// Turn off LEDs
+		hddled_write_pads_raw(hddleds[i], HDDLED_STATE_OFF);
+	}
+	hddledStatPage->stat = hddledStat;
+
+	timer_setup(&hddledPatternTimer, hddled_pattern_tick, 0);
+	timer_setup(&hddledSampleTimer, hddled_sample_tick, 0);
+	INIT_DELAYED_WORK(&hddledMdWork, hddled_md_work);
+	INIT_DEFERRABLE_WORK(&hddledTempWork, hddled_temp_work);
+	timer_setup(&hddledStandbyTimer, hddled_standby_tick, TIMER_DEFERRABLE);
+	timer_setup(&hddledAnimTimer, hddled_anim_tick, 0);
+	timer_setup(&hddledHeartbeatTimer, hddled_heartbeat_tick, TIMER_DEFERRABLE);
+	timer_setup(&hddledCoalesceTimer, hddled_coalesce_tick, 0);
+	INIT_WORK(&hddledNotifyWork, hddled_notify);
+	INIT_WORK(&hddledRescanWork, hddled_rescan);
+	init_irq_work(&hddledDesiredWork, hddled_apply_desired);
+	init_irq_work(&hddledFaultWork, hddled_apply_faults);
+
+	// Everything a file operation or attribute can reach is set up, create char devices
 	for (i = 0; i < sizeof(hddledDevices)/sizeof(struct device*); ++i) {
-		hddledDevices[i] = device_create(hddledClass, NULL, MKDEV(majorNumber, i), NULL, "%s%d", DEVICE_NAME, i+1);
+		hddledDevices[i] = device_create_with_groups(hddledClass, NULL, MKDEV(majorNumber, i), hddleds[i],
+							     hddled_groups, "%s%d", DEVICE_NAME, i+1);
+	}
+	hddledCtlDevice = device_create_with_groups(hddledClass, NULL, MKDEV(majorNumber, HDDLED_CTL_MINOR), NULL,
+						    hddled_ctl_groups, "%sctl", DEVICE_NAME);
+	hddledStatDevice = device_create(hddledClass, NULL, MKDEV(majorNumber, HDDLED_STAT_MINOR), NULL,
+					 "%sstat", DEVICE_NAME);
+	if (!IS_ERR(hddledCtlDevice)) {
+		// Callbacks only take hddledLock, so they can run straight from the timers
+		pm_runtime_irq_safe(hddledCtlDevice);
+		pm_runtime_set_active(hddledCtlDevice);
+		pm_runtime_enable(hddledCtlDevice);
 	}
 
-	// Create hddled iomaps
-	for (i = 0, offset = 0xC505B8; i < sizeof(hddleds)/sizeof(struct hddled*); ++i, offset += 0x8) {
-		hddleds[i] = create_hddled(base+offset);
-		// Turn off LEDs
-		*hddleds[i]->green |= 0x1;
-		*hddleds[i]->red &= 0xfffffffe;
+	err = genl_register_family(&hddled_genl_family);
+	if (err < 0)
+		printk(KERN_WARNING "HDDLed: failed to register generic netlink family (%d)\n", err);
+	else
+		hddledGenlRegistered = true;
+
+	// The block_rq_error tracepoint is not exported, so look it up by name
+	if (fault_latch) {
+		for_each_kernel_tracepoint(hddled_find_tracepoint, NULL);
+		err = hddledRqErrorTp ? tracepoint_probe_register(hddledRqErrorTp, hddled_rq_error, NULL) : -ENOENT;
+		if (err < 0)
+			printk(KERN_WARNING "HDDLed: failed to hook block errors (%d)\n", err);
+		else
+			hddledRqErrorRegistered = true;
 	}
+	// BPF is optional, the char devices work without it
+	err = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &hddled_kfunc_set);
+	if (err < 0)
+		printk(KERN_WARNING "HDDLed: failed to register BPF kfuncs (%d)\n", err);
+
+	// Only arms the frame timer, the first frame is the only pad write done here
+	if (boot_anim) {
+		spin_lock_irqsave(&hddledLock, flags);
+		hddled_start_anim(HDDLED_ANIM_BOOT);
+		spin_unlock_irqrestore(&hddledLock, flags);
+	}
+
+	if (panic_leds) {
+		atomic_notifier_chain_register(&panic_notifier_list, &hddledPanicNb);
+		register_die_notifier(&hddledDieNb);
+	}
+
+	if (autobind) {
+		hddled_resolve_ports();
+		err = bus_register_notifier(&scsi_bus_type, &hddledScsiNb);
+		if (err < 0)
+			printk(KERN_WARNING "HDDLed: failed to follow SCSI hotplug (%d)\n", err);
+		else
+			hddledScsiNotifier = true;
+		schedule_work(&hddledRescanWork);
+	}
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_idle();
+	spin_unlock_irqrestore(&hddledLock, flags);
 
 	printk(KERN_INFO "HDDLed: initialized\n");
 
@@ -154,13 +811,62 @@ static int __init hddled_init(void) {
 }
 
 static void __exit hddled_exit(void) {
+	bool genl = hddledGenlRegistered;
+	unsigned long flags;
 	int minor;
+	if (hddledScsiNotifier)
+		bus_unregister_notifier(&scsi_bus_type, &hddledScsiNb);
+	cancel_work_sync(&hddledRescanWork);
+	if (panic_leds) {
+		unregister_die_notifier(&hddledDieNb);
+		atomic_notifier_chain_unregister(&panic_notifier_list, &hddledPanicNb);
+	}
+	if (hddledRqErrorRegistered) {
+		tracepoint_probe_unregister(hddledRqErrorTp, hddled_rq_error, NULL);
+		tracepoint_synchronize_unregister();
+	}
+	if (!IS_ERR_OR_NULL(hddledCtlDevice)) {
+		pm_runtime_disable(hddledCtlDevice);
+		// The timers stop calling into runtime PM from here on
+		spin_lock_irqsave(&hddledLock, flags);
+		hddledCtlDevice = NULL;
+		spin_unlock_irqrestore(&hddledLock, flags);
+	}
 	for (minor = 0; minor < sizeof(hddledDevices)/sizeof(struct device*); ++minor) {
 		// Destroy char devices
 		device_destroy(hddledClass, MKDEV(majorNumber, minor));
-		// iounmap red and green led address in each hddled
-		iounmap(hddleds[minor]->green);
-		iounmap(hddleds[minor]->red);
+	}
+	device_destroy(hddledClass, MKDEV(majorNumber, HDDLED_CTL_MINOR));
+	device_destroy(hddledClass, MKDEV(majorNumber, HDDLED_STAT_MINOR));
+	irq_work_sync(&hddledDesiredWork);
+	irq_work_sync(&hddledFaultWork);
+	timer_shutdown_sync(&hddledPatternTimer);
+	timer_shutdown_sync(&hddledSampleTimer);
+	timer_shutdown_sync(&hddledStandbyTimer);
+	timer_shutdown_sync(&hddledAnimTimer);
+	timer_shutdown_sync(&hddledHeartbeatTimer);
+	timer_shutdown_sync(&hddledCoalesceTimer);
+	cancel_delayed_work_sync(&hddledMdWork);
+	cancel_delayed_work_sync(&hddledTempWork);
+	// Only netlink SET can still change a slot, so notifications are turned off and drained
+	// before the family goes away, and drained again for whatever a last SET queued
+	WRITE_ONCE(hddledGenlRegistered, false);
+	cancel_work_sync(&hddledNotifyWork);
+	if (genl)
+		genl_unregister_family(&hddled_genl_family);
+	cancel_work_sync(&hddledNotifyWork);
+	// LEDs are left as they are unless asked otherwise, so a reload with adopt is seamless
+	if (clear_on_exit) {
+		spin_lock_irqsave(&hddledLock, flags);
+		for (minor = 0; minor < sizeof(hddleds)/sizeof(struct hddled*); ++minor)
+			hddled_write_pads(hddleds[minor], HDDLED_STATE_OFF);
+		spin_unlock_irqrestore(&hddledLock, flags);
+	}
+	for (minor = 0; minor < sizeof(hddleds)/sizeof(struct hddled*); ++minor) {
+		// Release bound disks
+		if (hddleds[minor]->bdev_file)
+			fput(hddleds[minor]->bdev_file);
+		hddledBackend->unmap(hddleds[minor]);
 		// free hddled structrs
 		kfree(hddleds[minor]);
 		hddleds[minor] = NULL;
@@ -168,13 +874,20 @@ static void __exit hddled_exit(void) {
 	class_unregister(hddledClass);
 	class_destroy(hddledClass);
 	unregister_chrdev(majorNumber, "hddled");
+	// Nothing maps the page anymore, every mapping holds the file and with it the module
+	free_page((unsigned long)hddledStatPage);
 	printk(KERN_INFO "HDDLed: exited\n");
 }
 
 static int dev_open(struct inode *inodep, struct file *filep) {
 	// Allocate private_data struct to keep track of if the read function is done reading
 	struct private_data *pd = kmalloc(sizeof(struct private_data), GFP_KERNEL);
+	if (!pd)
+		return -ENOMEM;
 	pd->read_done = false;
+	hddled_bucket_init(&pd->bucket, jiffies, HZ);
+	mutex_init(&pd->txn_lock);
+	pd->txn_open = false;
 	filep->private_data = (void*)pd;
 	return 0;
 }
@@ -186,68 +899,1915 @@ static int dev_release(struct inode *inodep, struct file *filep) {
 	return 0;
 }
 
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
-	int err = 0, ret = 0;
-	size_t ret_len = 0;
-	char out[4] = { 0 };
-	int minor = iminor(filep->f_inode);
-	struct hddled* led = hddleds[minor];
-	struct private_data* pd = (struct private_data*)filep->private_data;
+static int hddled_get_state(struct hddled *led) {
+	return hddledBackend->get(led);
+}
 
-	// If we already returned the value to the user he should close the file
-	if (pd->read_done) return 0;
+static void hddled_write_pads_raw(struct hddled *led, int val) {
+	hddledBackend->set(led, val);
+}
 
-	// Calculate current state
-	ret = ((*led->green & 0x1) ^ 0x1) | ((*led->red & 0x1) << 1);
-	sprintf(out, "%d", ret);
-	ret_len = strlen(out);
+// Queues a netlink notification for the slot, safe in atomic context
+static void hddled_changed(struct hddled *led) {
+	if (!(atomic_fetch_or(BIT(led->index), &hddledChanged) & BIT(led->index)))
+		schedule_work(&hddledNotifyWork);
+}
 
-	err = copy_to_user(buffer, out, ret_len);
-	if (err == 0) {
-		pd->read_done = true;
-		return ret_len;
-	} else {
-		printk(KERN_ALERT "HDDLed: failed to send %d characters to the user\n", err);
-		return err;
+// Caller holds hddledLock, called when periodic work finds nothing left to do so runtime
+// PM can suspend hddledctl once every slot is static
+static void hddled_idle(void) {
+	if (!IS_ERR_OR_NULL(hddledCtlDevice))
+		pm_request_idle(hddledCtlDevice);
+}
+
+// Caller holds hddledLock, called whenever periodic work is started
+static void hddled_wake(void) {
+	if (!IS_ERR_OR_NULL(hddledCtlDevice) && pm_runtime_suspended(hddledCtlDevice))
+		pm_request_resume(hddledCtlDevice);
+}
+
+// Caller holds hddledLock
+static void hddled_kick_patterns(void) {
+	hddled_wake();
+	if (!timer_pending(&hddledPatternTimer))
+		mod_timer(&hddledPatternTimer, jiffies + msecs_to_jiffies(HDDLED_TICK_MS));
+}
+
+// Caller holds hddledLock, the static state the slot shows once empty, fault and standby
+// are taken into account
+static int hddled_shown_state(struct hddled *led) {
+	if (led->fault)
+		return HDDLED_STATE_RED;
+	if (led->empty)
+		return HDDLED_STATE_OFF;
+	if (led->standby)
+		return READ_ONCE(standby_led) & 0x3;
+	return led->core.state;
+}
+
+// Caller holds hddledLock, writes what the slot should currently show
+static void hddled_render(struct hddled *led) {
+	if (hddledAnim != HDDLED_ANIM_NONE)
+		return;
+	if (led->fault)
+		hddled_write_pads(led, HDDLED_STATE_RED);
+	else if (led->empty)
+		hddled_write_pads(led, HDDLED_STATE_OFF);
+	else if (led->standby)
+		hddled_write_pads(led, READ_ONCE(standby_led) & 0x3);
+	else if (led->core.source == HDDLED_LAYER_ACTIVITY && led->trigger == HDDLED_TRIGGER_HEARTBEAT)
+		hddled_write_pads(led, hddledHeartbeatOn ? HDDLED_STATE_GREEN : HDDLED_STATE_OFF);
+	else
+		hddled_write_pads(led, hddled_core_output(&led->core));
+}
+
+// Slots as the shared glue in hddled_core.h sees them, all of it runs under hddledLock
+static struct hddled_core *hddled_slot_core(void *ctx, int slot) {
+	return &hddleds[slot]->core;
+}
+
+static bool hddled_slot_fault(void *ctx, int slot) {
+	return hddleds[slot]->fault;
+}
+
+static void hddled_slot_changed(void *ctx, int slot, unsigned int changed) {
+	struct hddled *led = hddleds[slot];
+
+	if (changed & HDDLED_CORE_SOURCE)
+		hddled_publish(led, hddledStat.slots[led->index].state);
+	hddled_changed(led);
+	if ((changed & HDDLED_CORE_OUTPUT) && led->core.pattern_len)
+		hddled_kick_patterns();
+}
+
+static void hddled_slot_render(void *ctx, int slot) {
+	hddled_render(hddleds[slot]);
+}
+
+static const struct hddled_core_ops hddled_slot_ops = {
+	.core    = hddled_slot_core,
+	.fault   = hddled_slot_fault,
+	.changed = hddled_slot_changed,
+	.render  = hddled_slot_render,
+};
+
+// Caller holds hddledLock. Returns true only when what the pads should show changed
+static bool hddled_arbitrate(struct hddled *led) {
+	return hddled_core_update(&hddled_slot_ops, NULL, led->index);
+}
+
+// Caller holds hddledLock, returns true when the slot needs a render
+static bool hddled_store_layer(struct hddled *led, enum hddled_layer layer, int state,
+			       u32 pattern, unsigned int steps, unsigned int step_ms) {
+	return hddled_core_store(&hddled_slot_ops, NULL, led->index, layer, state, pattern, steps, step_ms);
+}
+
+// Caller holds hddledLock
+static void hddled_clear_layer(struct hddled *led, enum hddled_layer layer) {
+	hddled_core_clear(&hddled_slot_ops, NULL, led->index, layer);
+}
+
+// Caller holds hddledLock, sets every slot with states[i] >= 0 (see hddled_core_set_states)
+static void hddled_set_states(const int *states) {
+	hddled_core_set_states(&hddled_slot_ops, NULL, states);
+}
+
+// Caller holds hddledLock, holds states back as a unit when write_rate says so (see
+// hddled_limit_hold) for hddledCoalesceTimer to apply later
+static void hddled_limit_states(struct private_data *pd, int *states) {
+	unsigned int rate = READ_ONCE(write_rate);
+
+	if (hddled_limit_hold(hddledLimits, &pd->bucket, states, rate, jiffies, HZ) &&
+	    !timer_pending(&hddledCoalesceTimer))
+		mod_timer(&hddledCoalesceTimer, jiffies + max(1U, HZ / rate));
+}
+
+// Applies everything held back in one batch once every slot in it has a token
+static void hddled_coalesce_tick(struct timer_list *t) {
+	unsigned int rate = READ_ONCE(write_rate);
+	int states[HDDLED_SLOTS];
+	unsigned long flags;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	if (hddled_limit_flush(hddledLimits, states, rate, jiffies, HZ))
+		hddled_set_states(states);
+	else
+		mod_timer(&hddledCoalesceTimer, jiffies + max(1U, HZ / rate));
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
+
+// Caller holds hddledLock, a pattern with no steps falls back to the static state
+static void hddled_set_pattern(struct hddled *led, u32 pattern, unsigned int steps, unsigned int step_ms) {
+	if (hddled_store_layer(led, HDDLED_LAYER_USER, led->core.layers[HDDLED_LAYER_USER].state, pattern, steps, step_ms))
+		hddled_render(led);
+}
+
+static void hddled_pattern_tick(struct timer_list *t) {
+	struct hddled *led;
+	bool active = false;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		if (led->fault) {
+			if (READ_ONCE(fault_blink)) {
+				active = true;
+				if (hddledAnim == HDDLED_ANIM_NONE)
+					hddled_write_pads(led, (jiffies / msecs_to_jiffies(HDDLED_FAULT_BLINK_MS)) & 1 ?
+							  HDDLED_STATE_RED : HDDLED_STATE_OFF);
+			}
+			continue;
+		}
+		if (led->empty || led->standby || led->core.pattern_len == 0)
+			continue;
+		active = true;
+		if (hddled_core_tick(&led->core))
+			hddled_render(led);
 	}
+	if (active)
+		mod_timer(&hddledPatternTimer, jiffies + msecs_to_jiffies(HDDLED_TICK_MS));
+	else
+		hddled_idle();
+	spin_unlock_irqrestore(&hddledLock, flags);
 }
 
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
-	int err, val;
-	int minor = iminor(filep->f_inode);
-	struct hddled* led = hddleds[minor];
+static void hddled_apply_desired(struct irq_work *work) {
+	int i, states[HDDLED_SLOTS], desired = atomic_fetch_andnot(HDDLED_DESIRED_PENDING_MASK, &hddledDesired);
+	unsigned long flags;
 
-	err = kstrtoint_from_user(buffer, len, 10, &val);
-	if (err < 0) {
-		printk(KERN_ALERT "HDDLed: failed to read %d characters from the user\n", err);
-		return err;
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		states[i] = desired & HDDLED_DESIRED_PENDING(i) ? (desired >> (i * 2)) & 0x3 : -1;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_set_states(states);
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
+
+// Only a RCU lookup and an atomic OR, this runs for every failed request in the system
+static void hddled_rq_error(void *data, struct request *rq, blk_status_t error, unsigned int nr_bytes) {
+	struct gendisk *disk = rq->q->disk;
+	int i;
+
+	// A nowait request that would have blocked is not a disk fault. Requests on queues
+	// without a disk would match every unbound slot, whose disk is NULL too
+	if (error == BLK_STS_AGAIN || !disk)
+		return;
+
+	rcu_read_lock();
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (rcu_dereference(hddleds[i]->disk) != disk)
+			continue;
+		if (!(atomic_fetch_or(BIT(i), &hddledFault) & BIT(i)))
+			irq_work_queue(&hddledFaultWork);
 	}
+	rcu_read_unlock();
+}
 
-	// Green LED
-	if (val & 0x1) {
-		// Turning on
-		*led->green &= 0xfffffffe;
-	} else {
-		// Turning off
-		*led->green |= 0x1;
+static void hddled_apply_faults(struct irq_work *work) {
+	int i, faults = atomic_read(&hddledFault);
+	unsigned long flags;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (!(faults & BIT(i)) || hddleds[i]->fault)
+			continue;
+		hddleds[i]->fault = true;
+		hddled_arbitrate(hddleds[i]);
+		hddled_render(hddleds[i]);
+		hddled_changed(hddleds[i]);
+		printk(KERN_WARNING "HDDLed: latched slot %d after a block error\n", i+1);
 	}
+	if (READ_ONCE(fault_blink))
+		hddled_kick_patterns();
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
 
-	// Red LED
-	if (((val >> 1) & 0x1)) {
-		// Turning on
-		*led->red |= 0x1;
-	} else {
-		// Turning off
-		*led->red &= 0xfffffffe;
+// Caller holds hddledLock, every slot is written back to back
+static void hddled_show_frame(const struct hddled_anim_frame *frame) {
+	int i;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		hddled_write_pads(hddleds[i], (frame->states >> (i * 2)) & 0x3);
+}
+
+static void hddled_anim_tick(struct timer_list *t) {
+	const struct hddled_anim_frame *frame;
+	unsigned long flags;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	if (hddledAnim != HDDLED_ANIM_NONE) {
+		hddledAnimPos = (hddledAnimPos + 1) % hddledAnimCount;
+		frame = &hddledAnimFrames[hddledAnimPos];
+		hddled_show_frame(frame);
+		mod_timer(&hddledAnimTimer, jiffies + msecs_to_jiffies(max_t(u16, frame->ms, HDDLED_TICK_MS)));
 	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
 
-	return len;
+// Caller holds hddledLock, stopping gives every slot back what it showed before
+static int hddled_start_anim(unsigned int anim) {
+	int i;
+
+	switch (anim) {
+	case HDDLED_ANIM_NONE:
+		break;
+	case HDDLED_ANIM_CHASE:
+		hddledAnimFrames = hddled_anim_chase;
+		hddledAnimCount = ARRAY_SIZE(hddled_anim_chase);
+		break;
+	case HDDLED_ANIM_SWEEP:
+		hddledAnimFrames = hddled_anim_sweep;
+		hddledAnimCount = ARRAY_SIZE(hddled_anim_sweep);
+		break;
+	case HDDLED_ANIM_IDENTIFY:
+		hddledAnimFrames = hddled_anim_identify;
+		hddledAnimCount = ARRAY_SIZE(hddled_anim_identify);
+		break;
+	case HDDLED_ANIM_CUSTOM:
+		if (hddledCustomCount == 0)
+			return -ENODATA;
+		hddledAnimFrames = hddledCustomFrames;
+		hddledAnimCount = hddledCustomCount;
+		break;
+	case HDDLED_ANIM_BOOT:
+		hddledAnimFrames = hddled_anim_boot;
+		hddledAnimCount = ARRAY_SIZE(hddled_anim_boot);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	// Any other animation replaces the boot animation for good
+	hddledBooting = anim == HDDLED_ANIM_BOOT;
+	hddledAnim = anim;
+	if (anim == HDDLED_ANIM_NONE) {
+		timer_delete(&hddledAnimTimer);
+		for (i = 0; i < HDDLED_SLOTS; ++i)
+			hddled_render(hddleds[i]);
+		hddled_idle();
+		return 0;
+	}
+
+	hddled_wake();
+	hddledAnimPos = 0;
+	hddled_show_frame(&hddledAnimFrames[0]);
+	mod_timer(&hddledAnimTimer, jiffies + msecs_to_jiffies(max_t(u16, hddledAnimFrames[0].ms, HDDLED_TICK_MS)));
+	return 0;
 }
 
-static struct hddled* create_hddled(unsigned int addr) {
-	struct hddled *led = kmalloc(sizeof(struct hddled), GFP_KERNEL);
-	led->green = (volatile unsigned int *)ioremap(addr, 1);
-	led->red = (volatile unsigned int *)ioremap(addr+0x28, 1);
+// Caller holds hddledLock
+static void hddled_publish(struct hddled *led, int state) {
+	struct hddled_stat_slot *slot = &hddledStat.slots[led->index];
+
+	if (slot->state == state && slot->source == led->core.source)
+		return;
+	write_seqcount_begin(&hddledStatSeq);
+	if (slot->state != state) {
+		slot->state = state;
+		++slot->changes;
+		slot->last_change_ns = ktime_get_ns();
+	}
+	slot->source = led->core.source;
+	++hddledStat.generation;
+
+	// Same protocol for the mapped page, userspace cannot use the seqcount itself
+	WRITE_ONCE(hddledStatPage->seq, hddledStatPage->seq + 1);
+	smp_wmb();
+	hddledStatPage->stat.generation = hddledStat.generation;
+	hddledStatPage->stat.slots[led->index] = *slot;
+	smp_wmb();
+	WRITE_ONCE(hddledStatPage->seq, hddledStatPage->seq + 1);
+	write_seqcount_end(&hddledStatSeq);
+}
+
+// Caller holds hddledLock
+static void hddled_write_pads(struct hddled *led, int val) {
+	if (READ_ONCE(hddledPanicked))
+		return;
+	hddled_write_pads_raw(led, val);
+	hddled_publish(led, val & 0x3);
+}
+
+// Runs in panic or NMI context: takes no locks and allocates nothing, the pads are
+// mapped since init so they can be written directly
+static void hddled_panic_pads(int val) {
+	int i;
+
+	WRITE_ONCE(hddledPanicked, true);
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		hddled_write_pads_raw(hddleds[i], val);
+}
+
+static int hddled_panic_event(struct notifier_block *nb, unsigned long action, void *data) {
+	hddled_panic_pads(HDDLED_STATE_RED);
+	return NOTIFY_DONE;
+}
+
+// An oops may be survived, so it gets its own colour and a later panic still turns red
+static int hddled_die_event(struct notifier_block *nb, unsigned long action, void *data) {
+	if (action == DIE_OOPS)
+		hddled_panic_pads(HDDLED_STATE_BOTH);
+	return NOTIFY_DONE;
+}
+
+// Caller holds hddledLock, called on every write from userspace
+static void hddled_end_boot(void) {
+	if (likely(!hddledBooting))
+		return;
+	hddled_start_anim(HDDLED_ANIM_NONE);
+}
+
+// Length of the iovec segment the iterator is currently positioned in
+static size_t hddled_iter_seg_len(const struct iov_iter *iter) {
+	const struct iovec *iov;
+	unsigned long seg;
+	size_t skip;
+
+	if (!iter_is_iovec(iter))
+		return iov_iter_count(iter);
+
+	iov = iter_iov(iter);
+	skip = iter->iov_offset;
+	for (seg = 0; seg < iter->nr_segs; ++seg, ++iov, skip = 0) {
+		if (iov->iov_len > skip)
+			return min(iov->iov_len - skip, iov_iter_count(iter));
+	}
+	return 0;
+}
+
+static ssize_t ctl_write_iter(struct private_data *pd, struct iov_iter *from) {
+	char buf[HDDLED_CTL_BUF];
+	int err, states[HDDLED_SLOTS];
+	size_t len = iov_iter_count(from), pos = 0, seg;
+	unsigned long flags;
+
+	// Join the segments with newlines so every iovec is its own record
+	while (iov_iter_count(from)) {
+		seg = hddled_iter_seg_len(from);
+		if (pos + seg + 1 >= sizeof(buf))
+			return -EINVAL;
+		if (!copy_from_iter_full(buf + pos, seg, from))
+			return -EFAULT;
+		pos += seg;
+		buf[pos++] = '\n';
+	}
+
+	// Nothing touches the hardware unless every record parsed
+	err = hddled_parse_batch(buf, pos, states);
+	if (err < 0) {
+		printk_ratelimited(KERN_ALERT "HDDLed: rejected malformed control write\n");
+		return err;
+	}
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_end_boot();
+	hddled_limit_states(pd, states);
+	hddled_set_states(states);
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	return len;
+}
+
+static ssize_t ctl_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	char out[HDDLED_SLOTS*2];
+	size_t copied;
+	unsigned long flags;
+	int i;
+
+	if (iocb->ki_pos >= sizeof(out) || !iov_iter_count(to))
+		return 0;
+
+	// One "<state>\n" line per slot, taken as a single snapshot
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		out[i*2] = '0' + hddled_get_state(hddleds[i]);
+		out[i*2+1] = '\n';
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	copied = copy_to_iter(out + iocb->ki_pos, sizeof(out) - iocb->ki_pos, to);
+	if (copied == 0)
+		return -EFAULT;
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+// Lockless against the writers, a read that raced with a change is simply retried. Reads
+// move the file position and end in EOF like any file, collectors that keep the file open
+// pread it at offset 0
+static ssize_t stat_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	struct hddled_stat stat;
+	unsigned int seq;
+	size_t copied;
+
+	if (iocb->ki_pos >= sizeof(stat) || !iov_iter_count(to))
+		return 0;
+
+	do {
+		seq = read_seqcount_begin(&hddledStatSeq);
+		stat = hddledStat;
+	} while (read_seqcount_retry(&hddledStatSeq, seq));
+
+	copied = copy_to_iter((char *)&stat + iocb->ki_pos, sizeof(stat) - iocb->ki_pos, to);
+	if (copied == 0)
+		return -EFAULT;
+	iocb->ki_pos += copied;
+	return copied;
+}
+
+// Only the status page of /dev/hddledstat can be mapped, and only for reading
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma) {
+	if (iminor(file_inode(filep)) != HDDLED_STAT_MINOR)
+		return -ENODEV;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_mod(vma, VM_DONTEXPAND | VM_DONTDUMP, VM_MAYWRITE);
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(hddledStatPage) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
+}
+
+static ssize_t dev_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+	int ret = 0;
+	size_t ret_len = 0, copied;
+	char out[4] = { 0 };
+	int minor = iminor(file_inode(iocb->ki_filp));
+	struct hddled* led;
+	struct private_data* pd = (struct private_data*)iocb->ki_filp->private_data;
+
+	if (minor == HDDLED_CTL_MINOR)
+		return ctl_read_iter(iocb, to);
+	if (minor == HDDLED_STAT_MINOR)
+		return stat_read_iter(iocb, to);
+	led = hddleds[minor];
+
+	// If we already returned the value to the user he should close the file
+	if (pd->read_done || !iov_iter_count(to)) return 0;
+
+	// Calculate current state
+	ret = hddled_get_state(led);
+	sprintf(out, "%d", ret);
+	ret_len = strlen(out);
+
+	copied = copy_to_iter(out, ret_len, to);
+	if (copied == ret_len) {
+		pd->read_done = true;
+		return ret_len;
+	} else {
+		printk(KERN_ALERT "HDDLed: failed to send %zu characters to the user\n", ret_len - copied);
+		return -EFAULT;
+	}
+}
+
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+	int i, err, val, states[HDDLED_SLOTS];
+	char buf[16];
+	size_t len = iov_iter_count(from);
+	int minor = iminor(file_inode(iocb->ki_filp));
+	struct private_data *pd = iocb->ki_filp->private_data;
+	unsigned long flags;
+
+	if (minor == HDDLED_CTL_MINOR)
+		return ctl_write_iter(pd, from);
+	if (minor == HDDLED_STAT_MINOR)
+		return -EPERM;
+
+	// All segments of a writev form a single value, same as a plain write
+	if (len >= sizeof(buf))
+		return -EINVAL;
+	if (!copy_from_iter_full(buf, len, from))
+		return -EFAULT;
+
+	err = hddled_parse_int(buf, len, &val);
+	if (err < 0) {
+		printk_ratelimited(KERN_ALERT "HDDLed: failed to read %d characters from the user\n", err);
+		return err;
+	}
+
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		states[i] = i == minor ? val & 0x3 : -1;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_end_boot();
+	hddled_limit_states(pd, states);
+	hddled_set_states(states);
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	return len;
+}
+
+static int dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+	const struct hddled_uring_cmd *cmd = io_uring_sqe_cmd(ioucmd->sqe);
+	struct private_data *pd = ioucmd->file->private_data;
+	int minor = iminor(file_inode(ioucmd->file));
+	int states[HDDLED_SLOTS];
+	u32 slot = READ_ONCE(cmd->slot);
+	u32 state = READ_ONCE(cmd->state);
+	u32 pattern = READ_ONCE(cmd->pattern);
+	u16 step_ms = READ_ONCE(cmd->step_ms);
+	u8 steps = READ_ONCE(cmd->steps);
+	struct hddled *led = NULL;
+	unsigned long flags;
+	int i, ret = 0;
+
+	if (minor == HDDLED_STAT_MINOR)
+		return -EINVAL;
+	// Only GET is allowed on a file that was not opened for writing
+	if (ioucmd->cmd_op != HDDLED_URING_GET && !(ioucmd->file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	// Slot 0 addresses the slot of the opened /dev/hddledN
+	if (slot == 0 && minor != HDDLED_CTL_MINOR)
+		led = hddleds[minor];
+	else if (slot >= 1 && slot <= HDDLED_SLOTS)
+		led = hddleds[slot-1];
+
+	// Everything completes inline, the return value ends up in the CQE
+	spin_lock_irqsave(&hddledLock, flags);
+	if (ioucmd->cmd_op != HDDLED_URING_GET)
+		hddled_end_boot();
+	switch (ioucmd->cmd_op) {
+	case HDDLED_URING_SET:
+		if (!led || state > HDDLED_STATE_BOTH) {
+			ret = -EINVAL;
+			break;
+		}
+		for (i = 0; i < HDDLED_SLOTS; ++i)
+			states[i] = i == led->index ? state : -1;
+		hddled_limit_states(pd, states);
+		hddled_set_states(states);
+		break;
+	case HDDLED_URING_GET:
+		if (!led)
+			ret = -EINVAL;
+		else
+			ret = hddled_get_state(led);
+		break;
+	case HDDLED_URING_SET_PATTERN:
+		if (!led || steps > HDDLED_PATTERN_MAX_STEPS)
+			ret = -EINVAL;
+		else
+			hddled_set_pattern(led, pattern, steps, step_ms);
+		break;
+	case HDDLED_URING_SET_ALL:
+		if (state >> (HDDLED_SLOTS * 2)) {
+			ret = -EINVAL;
+			break;
+		}
+		for (i = 0; i < HDDLED_SLOTS; ++i)
+			states[i] = (state >> (i * 2)) & 0x3;
+		hddled_limit_states(pd, states);
+		hddled_set_states(states);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	return ret;
+}
+
+static int hddled_upload_anim(const struct hddled_anim __user *uanim) {
+	struct hddled_anim *anim;
+	unsigned long flags;
+	int i, ret = 0;
+
+	anim = memdup_user(uanim, sizeof(*anim));
+	if (IS_ERR(anim))
+		return PTR_ERR(anim);
+	if (anim->count == 0 || anim->count > HDDLED_ANIM_MAX_FRAMES) {
+		ret = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < anim->count; ++i) {
+		if (anim->frames[i].states >> (HDDLED_SLOTS * 2)) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	spin_lock_irqsave(&hddledLock, flags);
+	memcpy(hddledCustomFrames, anim->frames, anim->count * sizeof(anim->frames[0]));
+	hddledCustomCount = anim->count;
+	if (hddledAnim == HDDLED_ANIM_CUSTOM)
+		hddled_start_anim(HDDLED_ANIM_CUSTOM);
+	spin_unlock_irqrestore(&hddledLock, flags);
+out:
+	kfree(anim);
+	return ret;
+}
+
+// Transactions are staged per open file of /dev/hddledctl and applied in one go on commit
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+	struct private_data *pd = filep->private_data;
+	int states[HDDLED_SLOTS];
+	struct hddled_txn_set set;
+	unsigned long flags;
+	long ret = 0;
+	u32 anim;
+	int i;
+
+	if (iminor(file_inode(filep)) != HDDLED_CTL_MINOR)
+		return -ENOTTY;
+	// Dropping a staged transaction is the only thing a read-only open may do
+	if (cmd != HDDLED_IOC_ABORT && !(filep->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	mutex_lock(&pd->txn_lock);
+	switch (cmd) {
+	case HDDLED_IOC_BEGIN:
+		for (i = 0; i < HDDLED_SLOTS; ++i)
+			pd->txn[i] = -1;
+		pd->txn_open = true;
+		break;
+	case HDDLED_IOC_SET:
+		if (!pd->txn_open) {
+			ret = -EINVAL;
+			break;
+		}
+		if (copy_from_user(&set, (void __user *)arg, sizeof(set))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (set.slot < 1 || set.slot > HDDLED_SLOTS || set.state > HDDLED_STATE_BOTH) {
+			ret = -EINVAL;
+			break;
+		}
+		pd->txn[set.slot-1] = set.state;
+		break;
+	case HDDLED_IOC_COMMIT:
+		if (!pd->txn_open) {
+			ret = -EINVAL;
+			break;
+		}
+		// The limiter clears what it holds back, the staged values stay as they are
+		memcpy(states, pd->txn, sizeof(states));
+		spin_lock_irqsave(&hddledLock, flags);
+		hddled_end_boot();
+		hddled_limit_states(pd, states);
+		hddled_set_states(states);
+		spin_unlock_irqrestore(&hddledLock, flags);
+		pd->txn_open = false;
+		break;
+	case HDDLED_IOC_ABORT:
+		pd->txn_open = false;
+		break;
+	case HDDLED_IOC_ANIM_UPLOAD:
+		ret = hddled_upload_anim((const struct hddled_anim __user *)arg);
+		break;
+	case HDDLED_IOC_ANIM_START:
+		if (get_user(anim, (const u32 __user *)arg)) {
+			ret = -EFAULT;
+			break;
+		}
+		spin_lock_irqsave(&hddledLock, flags);
+		ret = hddled_start_anim(anim);
+		spin_unlock_irqrestore(&hddledLock, flags);
+		break;
+	default:
+		ret = -ENOTTY;
+	}
+	mutex_unlock(&pd->txn_lock);
+
+	return ret;
+}
+
+static int hddled_genl_fill(struct sk_buff *skb, struct hddled *led, u8 cmd, u32 portid, u32 seq, int flags) {
+	unsigned long irqflags;
+	u32 state, pattern;
+	bool patterned;
+	void *hdr;
+
+	spin_lock_irqsave(&hddledLock, irqflags);
+	// What the slot shows, a latched or empty bay is not reported with the state below it
+	state = hddled_shown_state(led);
+	pattern = led->core.pattern;
+	patterned = led->core.pattern_len != 0 && !led->fault && !led->empty && !led->standby;
+	spin_unlock_irqrestore(&hddledLock, irqflags);
+
+	hdr = genlmsg_put(skb, portid, seq, &hddled_genl_family, flags, cmd);
+	if (!hdr)
+		return -EMSGSIZE;
+	if (nla_put_u32(skb, HDDLED_ATTR_SLOT, led->index + 1) ||
+	    nla_put_u32(skb, HDDLED_ATTR_STATE, state) ||
+	    (patterned && nla_put_u32(skb, HDDLED_ATTR_PATTERN, pattern))) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+	genlmsg_end(skb, hdr);
+	return 0;
+}
+
+static int hddled_genl_set(struct sk_buff *skb, struct genl_info *info) {
+	int i, states[HDDLED_SLOTS];
+	struct nlattr *attr = info->attrs[HDDLED_ATTR_STATES];
+	unsigned long flags;
+	const u8 *batch;
+
+	if (attr) {
+		batch = nla_data(attr);
+		for (i = 0; i < HDDLED_SLOTS; ++i) {
+			if (batch[i] != 0xff && batch[i] > HDDLED_STATE_BOTH) {
+				NL_SET_ERR_MSG_ATTR(info->extack, attr, "invalid state");
+				return -EINVAL;
+			}
+			states[i] = batch[i] == 0xff ? -1 : batch[i];
+		}
+	} else {
+		if (GENL_REQ_ATTR_CHECK(info, HDDLED_ATTR_SLOT) || GENL_REQ_ATTR_CHECK(info, HDDLED_ATTR_STATE))
+			return -EINVAL;
+		for (i = 0; i < HDDLED_SLOTS; ++i)
+			states[i] = -1;
+		states[nla_get_u32(info->attrs[HDDLED_ATTR_SLOT]) - 1] = nla_get_u32(info->attrs[HDDLED_ATTR_STATE]);
+	}
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_end_boot();
+	hddled_set_states(states);
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	return 0;
+}
+
+static int hddled_genl_get(struct sk_buff *skb, struct genl_info *info) {
+	struct sk_buff *msg;
+	int err;
+
+	if (GENL_REQ_ATTR_CHECK(info, HDDLED_ATTR_SLOT))
+		return -EINVAL;
+
+	msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+	if (!msg)
+		return -ENOMEM;
+	err = hddled_genl_fill(msg, hddleds[nla_get_u32(info->attrs[HDDLED_ATTR_SLOT]) - 1],
+			       HDDLED_CMD_GET, info->snd_portid, info->snd_seq, 0);
+	if (err < 0) {
+		nlmsg_free(msg);
+		return err;
+	}
+	return genlmsg_reply(msg, info);
+}
+
+static int hddled_genl_dump(struct sk_buff *skb, struct netlink_callback *cb) {
+	int i;
+
+	for (i = cb->args[0]; i < HDDLED_SLOTS; ++i) {
+		if (hddled_genl_fill(skb, hddleds[i], HDDLED_CMD_GET, NETLINK_CB(cb->skb).portid,
+				     cb->nlh->nlmsg_seq, NLM_F_MULTI) < 0)
+			break;
+	}
+	cb->args[0] = i;
+	return skb->len;
+}
+
+// Changes made in the meantime are coalesced, listeners get the latest state of each slot
+static void hddled_notify(struct work_struct *work) {
+	unsigned long changed = atomic_xchg(&hddledChanged, 0);
+	struct sk_buff *msg;
+	int i;
+
+	if (!READ_ONCE(hddledGenlRegistered) || !genl_has_listeners(&hddled_genl_family, &init_net, 0))
+		return;
+
+	for_each_set_bit(i, &changed, HDDLED_SLOTS) {
+		msg = genlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
+		if (!msg)
+			return;
+		if (hddled_genl_fill(msg, hddleds[i], HDDLED_CMD_NOTIFY, 0, 0, 0) < 0) {
+			nlmsg_free(msg);
+			continue;
+		}
+		genlmsg_multicast(&hddled_genl_family, msg, 0, 0, GFP_KERNEL);
+	}
+}
+
+static const struct nla_policy hddled_genl_policy[HDDLED_ATTR_MAX + 1] = {
+	[HDDLED_ATTR_SLOT]    = NLA_POLICY_RANGE(NLA_U32, 1, HDDLED_SLOTS),
+	[HDDLED_ATTR_STATE]   = NLA_POLICY_MAX(NLA_U32, HDDLED_STATE_BOTH),
+	[HDDLED_ATTR_STATES]  = NLA_POLICY_EXACT_LEN(HDDLED_SLOTS),
+	[HDDLED_ATTR_PATTERN] = { .type = NLA_U32 },
+};
+
+static const struct genl_ops hddled_genl_ops[] = {
+	{
+		.cmd    = HDDLED_CMD_SET,
+		.doit   = hddled_genl_set,
+		.flags  = GENL_ADMIN_PERM,
+	},
+	{
+		.cmd    = HDDLED_CMD_GET,
+		.doit   = hddled_genl_get,
+		.dumpit = hddled_genl_dump,
+	},
+};
+
+static const struct genl_multicast_group hddled_genl_mcgrps[] = {
+	{ .name = HDDLED_GENL_MCGRP },
+};
+
+static struct genl_family hddled_genl_family = {
+	.name     = HDDLED_GENL_NAME,
+	.version  = HDDLED_GENL_VERSION,
+	.maxattr  = HDDLED_ATTR_MAX,
+	.policy   = hddled_genl_policy,
+	.module   = THIS_MODULE,
+	.ops      = hddled_genl_ops,
+	.n_ops    = ARRAY_SIZE(hddled_genl_ops),
+	.mcgrps   = hddled_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(hddled_genl_mcgrps),
+};
+
+// Caller holds hddledLock, restarts the averages from the current disk counters
+static void hddled_reset_activity(struct hddled *led) {
+	struct block_device *bdev;
+
+	ewma_hddled_io_init(&led->rate);
+	ewma_hddled_io_init(&led->util);
+	if (!led->bdev_file)
+		return;
+	bdev = file_bdev(led->bdev_file);
+	led->last_sectors = part_stat_read(bdev, sectors[STAT_READ]) + part_stat_read(bdev, sectors[STAT_WRITE]);
+	led->last_io_ticks = part_stat_read(bdev, io_ticks);
+}
+
+// Caller holds hddledLock
+static void hddled_start_sampling(void) {
+	hddled_wake();
+	if (!timer_pending(&hddledSampleTimer)) {
+		hddledLastSample = jiffies;
+		mod_timer(&hddledSampleTimer, jiffies + msecs_to_jiffies(HDDLED_SAMPLE_MS));
+	}
+}
+
+// Caller holds hddledLock, kicks whatever drives the trigger of a bound slot
+static void hddled_start_trigger(struct hddled *led) {
+	if (led->trigger == HDDLED_TRIGGER_HEARTBEAT) {
+		hddled_wake();
+		if (!timer_pending(&hddledHeartbeatTimer))
+			mod_timer(&hddledHeartbeatTimer, jiffies + 1);
+		return;
+	}
+	if (!led->bdev_file)
+		return;
+	switch (led->trigger) {
+	case HDDLED_TRIGGER_ACTIVITY:
+		hddled_start_sampling();
+		break;
+	case HDDLED_TRIGGER_MD:
+		hddled_wake();
+		mod_delayed_work(system_wq, &hddledMdWork, 0);
+		break;
+	case HDDLED_TRIGGER_TEMP:
+		hddled_wake();
+		mod_delayed_work(system_wq, &hddledTempWork, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+// Double pulse like ledtrig-heartbeat, the period grows shorter as the load goes up. A hung
+// kernel stops the timer, so the LED freezes instead of pulsing
+static void hddled_heartbeat_tick(struct timer_list *t) {
+	unsigned long flags, period, delay = 0;
+	bool active = false;
+	int i;
+
+	period = msecs_to_jiffies(300 + ((6720 << FSHIFT) / (5 * avenrun[0] + (7 << FSHIFT))));
+	switch (hddledHeartbeatPhase) {
+	case 0:
+		hddledHeartbeatOn = true;
+		delay = msecs_to_jiffies(70);
+		break;
+	case 1:
+		hddledHeartbeatOn = false;
+		delay = period / 4 - msecs_to_jiffies(70);
+		break;
+	case 2:
+		hddledHeartbeatOn = true;
+		delay = msecs_to_jiffies(70);
+		break;
+	default:
+		hddledHeartbeatOn = false;
+		delay = period - period / 4 - msecs_to_jiffies(70);
+		break;
+	}
+	hddledHeartbeatPhase = (hddledHeartbeatPhase + 1) % 4;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (hddleds[i]->trigger != HDDLED_TRIGGER_HEARTBEAT)
+			continue;
+		active = true;
+		if (!hddleds[i]->empty && !hddleds[i]->standby)
+			hddled_render(hddleds[i]);
+	}
+	if (active)
+		mod_timer(&hddledHeartbeatTimer, jiffies + max(1UL, delay));
+	else
+		hddled_idle();
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
+
+// Caller holds hddledLock, sets the trigger's layer. A running pattern is left alone when
+// it would not change, restarting it would only make the blinking stutter
+static void hddled_update_pattern(struct hddled *led, u32 pattern, unsigned int steps, unsigned int step_ms) {
+	if (hddled_store_layer(led, HDDLED_LAYER_ACTIVITY, pattern & 0x3, pattern, steps, step_ms))
+		hddled_render(led);
+}
+
+// Caller holds hddledLock, sets the trigger's layer
+static void hddled_update_state(struct hddled *led, int state) {
+	if (hddled_store_layer(led, HDDLED_LAYER_ACTIVITY, state, 0, 0, 0))
+		hddled_render(led);
+}
+
+// Caller holds hddledLock. Colour follows load (green, orange when heavy, red when the
+// disk is saturated) and blinking gets faster with throughput, an idle disk stays lit
+static void hddled_show_activity(struct hddled *led) {
+	unsigned long rate = ewma_hddled_io_read(&led->rate);
+	unsigned long util = ewma_hddled_io_read(&led->util);
+	unsigned int heavy = max(1U, READ_ONCE(activity_heavy));
+	unsigned int colour, step_ms;
+
+	if (util >= HDDLED_ACTIVITY_SATURATED)
+		colour = HDDLED_STATE_RED;
+	else if (rate >= heavy)
+		colour = HDDLED_STATE_BOTH;
+	else
+		colour = HDDLED_STATE_GREEN;
+
+	if (rate == 0) {
+		hddled_update_state(led, colour);
+		return;
+	}
+
+	step_ms = HDDLED_ACTIVITY_SLOW_MS -
+		(HDDLED_ACTIVITY_SLOW_MS - HDDLED_ACTIVITY_FAST_MS) * min_t(unsigned long, rate, heavy) / heavy;
+	hddled_update_pattern(led, colour, 2, step_ms);
+}
+
+static void hddled_sample_tick(struct timer_list *t) {
+	unsigned long flags, now, elapsed, sectors, io_ticks;
+	struct block_device *bdev;
+	struct hddled *led;
+	bool active = false;
+	int i;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	now = jiffies;
+	elapsed = max(1UL, now - hddledLastSample);
+	hddledLastSample = now;
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		if (led->trigger != HDDLED_TRIGGER_ACTIVITY || !led->bdev_file || led->standby)
+			continue;
+		active = true;
+
+		// Only the disk counters are read, the cost does not depend on the amount of I/O
+		bdev = file_bdev(led->bdev_file);
+		sectors = part_stat_read(bdev, sectors[STAT_READ]) + part_stat_read(bdev, sectors[STAT_WRITE]);
+		io_ticks = part_stat_read(bdev, io_ticks);
+		ewma_hddled_io_add(&led->rate, (sectors - led->last_sectors) / 2 * HZ / elapsed);
+		ewma_hddled_io_add(&led->util, min(1000UL, (io_ticks - led->last_io_ticks) * 1000 / elapsed));
+		led->last_sectors = sectors;
+		led->last_io_ticks = io_ticks;
+
+		hddled_show_activity(led);
+	}
+	if (active)
+		mod_timer(&hddledSampleTimer, jiffies + msecs_to_jiffies(HDDLED_SAMPLE_MS));
+	else
+		hddled_idle();
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
+
+enum hddled_md_state {
+	HDDLED_MD_ABSENT,
+	HDDLED_MD_HEALTHY,
+	HDDLED_MD_REBUILDING,
+	HDDLED_MD_FAULTY,
+};
+
+struct hddled_md_dir {
+	struct dir_context ctx;
+	char members[HDDLED_MD_MEMBERS][DISK_NAME_LEN];
+	int count;
+};
+
+// Collects the "dev-<member>" entries of /sys/block/<array>/md
+static bool hddled_md_filldir(struct dir_context *ctx, const char *name, int len, loff_t off, u64 ino, unsigned int type) {
+	struct hddled_md_dir *dir = container_of(ctx, struct hddled_md_dir, ctx);
+
+	if (len <= 4 || strncmp(name, "dev-", 4) != 0 || len - 4 >= DISK_NAME_LEN)
+		return true;
+	if (dir->count == HDDLED_MD_MEMBERS)
+		return false;
+	memcpy(dir->members[dir->count], name + 4, len - 4);
+	dir->members[dir->count][len - 4] = '\0';
+	++dir->count;
+	return true;
+}
+
+static int hddled_read_sysfs(const char *path, char *buf, size_t len) {
+	struct file *f = filp_open(path, O_RDONLY, 0);
+	loff_t pos = 0;
+	ssize_t n;
+
+	if (IS_ERR(f))
+		return PTR_ERR(f);
+	n = kernel_read(f, buf, len - 1, &pos);
+	filp_close(f, NULL);
+	if (n < 0)
+		return n;
+	buf[n] = '\0';
+	return n;
+}
+
+// Member is the whole disk or one of its partitions (sda, sda1, nvme0n1p1)
+static bool hddled_md_member_of(const char *member, const char *disk) {
+	size_t len = strlen(disk);
+
+	if (!*disk || strncmp(member, disk, len) != 0)
+		return false;
+	member += len;
+	if (*member == 'p' && isdigit(disk[len - 1]))
+		++member;
+	while (isdigit(*member))
+		++member;
+	return *member == '\0';
+}
+
+static void hddled_md_sample_array(const char *array, char (*disks)[DISK_NAME_LEN],
+				   int *states, unsigned int *progress, struct hddled_md_dir *dir) {
+	char path[96], buf[64];
+	unsigned long long done, total;
+	unsigned int permille = 0;
+	bool syncing;
+	struct file *f;
+	int i, m;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/md/sync_action", array);
+	if (hddled_read_sysfs(path, buf, sizeof(buf)) < 0)
+		return;
+	syncing = strncmp(buf, "idle", 4) != 0 && strncmp(buf, "frozen", 6) != 0;
+	if (syncing) {
+		snprintf(path, sizeof(path), "/sys/block/%s/md/sync_completed", array);
+		if (hddled_read_sysfs(path, buf, sizeof(buf)) >= 0 &&
+		    sscanf(buf, "%llu / %llu", &done, &total) == 2 && total)
+			permille = div64_u64(min(done, total) * 1000, total);
+	}
+
+	snprintf(path, sizeof(path), "/sys/block/%s/md", array);
+	f = filp_open(path, O_RDONLY | O_DIRECTORY, 0);
+	if (IS_ERR(f))
+		return;
+	dir->count = 0;
+	iterate_dir(f, &dir->ctx);
+	filp_close(f, NULL);
+
+	for (m = 0; m < dir->count; ++m) {
+		for (i = 0; i < HDDLED_SLOTS; ++i) {
+			if (!hddled_md_member_of(dir->members[m], disks[i]))
+				continue;
+			snprintf(path, sizeof(path), "/sys/block/%s/md/dev-%s/state", array, dir->members[m]);
+			if (hddled_read_sysfs(path, buf, sizeof(buf)) < 0)
+				continue;
+			// A disk with several member partitions shows its worst one
+			if (strstr(buf, "faulty")) {
+				states[i] = HDDLED_MD_FAULTY;
+				continue;
+			}
+			if (strstr(buf, "in_sync")) {
+				states[i] = max(states[i], (int)HDDLED_MD_HEALTHY);
+				continue;
+			}
+			// md shows "spare" for every member that is not in sync, a recovery target is
+			// the one that already has a slot in the array
+			snprintf(path, sizeof(path), "/sys/block/%s/md/dev-%s/slot", array, dir->members[m]);
+			if (hddled_read_sysfs(path, buf, sizeof(buf)) < 0 || !strncmp(buf, "none", 4)) {
+				states[i] = max(states[i], (int)HDDLED_MD_HEALTHY);
+				continue;
+			}
+			states[i] = max(states[i], (int)HDDLED_MD_REBUILDING);
+			progress[i] = syncing ? permille : 0;
+		}
+	}
+}
+
+// Faulty members go solid red, rebuild targets blink orange faster as recovery
+// progresses and healthy members stay green
+static void hddled_md_work(struct work_struct *work) {
+	char disks[HDDLED_SLOTS][DISK_NAME_LEN] = { { 0 } };
+	int i, states[HDDLED_SLOTS] = { HDDLED_MD_ABSENT };
+	unsigned int progress[HDDLED_SLOTS] = { 0 };
+	struct hddled_md_dir *dir;
+	char *arrays, *p, *array;
+	unsigned long flags;
+	bool active = false;
+
+	mutex_lock(&hddledBindLock);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (READ_ONCE(hddleds[i]->trigger) != HDDLED_TRIGGER_MD || !hddleds[i]->bdev_file ||
+		    READ_ONCE(hddleds[i]->standby))
+			continue;
+		strscpy(disks[i], file_bdev(hddleds[i]->bdev_file)->bd_disk->disk_name, DISK_NAME_LEN);
+		active = true;
+	}
+	mutex_unlock(&hddledBindLock);
+	if (!active) {
+		spin_lock_irqsave(&hddledLock, flags);
+		hddled_idle();
+		spin_unlock_irqrestore(&hddledLock, flags);
+		return;
+	}
+
+	dir = kzalloc(sizeof(*dir), GFP_KERNEL);
+	arrays = kstrdup(md_arrays, GFP_KERNEL);
+	if (dir && arrays) {
+		dir->ctx.actor = hddled_md_filldir;
+		p = arrays;
+		while ((array = strsep(&p, ",")) != NULL) {
+			array = strim(array);
+			if (*array && !strchr(array, '/'))
+				hddled_md_sample_array(array, disks, states, progress, dir);
+		}
+	}
+	kfree(arrays);
+	kfree(dir);
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (hddleds[i]->trigger != HDDLED_TRIGGER_MD || !disks[i][0])
+			continue;
+		switch (states[i]) {
+		case HDDLED_MD_FAULTY:
+			hddled_update_state(hddleds[i], HDDLED_STATE_RED);
+			break;
+		case HDDLED_MD_REBUILDING:
+			hddled_update_pattern(hddleds[i], HDDLED_STATE_BOTH, 2,
+					      HDDLED_MD_SLOW_MS - (HDDLED_MD_SLOW_MS - HDDLED_MD_FAST_MS) * progress[i] / 1000);
+			break;
+		case HDDLED_MD_HEALTHY:
+			hddled_update_state(hddleds[i], HDDLED_STATE_GREEN);
+			break;
+		default:
+			hddled_update_state(hddleds[i], HDDLED_STATE_OFF);
+		}
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	schedule_delayed_work(&hddledMdWork, msecs_to_jiffies(max(100U, READ_ONCE(md_interval))));
+}
+
+static int hddled_match_hwmon(struct device *dev, const void *data) {
+	return dev->class && !strcmp(dev->class->name, "hwmon");
+}
+
+// Caller holds hddledLock, steps between levels with hysteresis on the way down
+static void hddled_show_temp(struct hddled *led) {
+	int temp = led->temp / 1000;
+
+	if (temp >= led->temp_crit)
+		led->temp_level = 2;
+	else if (temp >= led->temp_warn)
+		led->temp_level = max(led->temp_level, 1);
+	if (led->temp_level == 2 && temp < led->temp_crit - led->temp_hyst)
+		led->temp_level = temp >= led->temp_warn ? 1 : 0;
+	if (led->temp_level == 1 && temp < led->temp_warn - led->temp_hyst)
+		led->temp_level = 0;
+
+	hddled_update_state(led, led->temp_level == 2 ? HDDLED_STATE_RED :
+				 led->temp_level == 1 ? HDDLED_STATE_BOTH : HDDLED_STATE_GREEN);
+}
+
+// Reads the drivetemp sensor of each bound disk. Reading it issues ATA commands, so a disk
+// that took no I/O since the last read is left alone in case it has spun down
+static void hddled_temp_work(struct work_struct *work) {
+	char hwmon[HDDLED_SLOTS][16] = { { 0 } };
+	char path[64], buf[16];
+	int i, temp[HDDLED_SLOTS];
+	struct block_device *bdev;
+	struct device *dev;
+	unsigned long ios, flags;
+	bool active = false;
+	struct hddled *led;
+
+	mutex_lock(&hddledBindLock);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		if (READ_ONCE(led->trigger) != HDDLED_TRIGGER_TEMP || !led->bdev_file ||
+		    READ_ONCE(led->empty) || READ_ONCE(led->standby))
+			continue;
+		active = true;
+		bdev = file_bdev(led->bdev_file);
+		ios = part_stat_read(bdev, ios[STAT_READ]) + part_stat_read(bdev, ios[STAT_WRITE]);
+		// An idle disk that still spins keeps warming up, so it is read every so often
+		if (led->temp && ios == led->temp_ios && ++led->temp_skips < HDDLED_TEMP_MAX_SKIPS)
+			continue;
+		led->temp_ios = ios;
+		led->temp_skips = 0;
+		// drivetemp registers its hwmon device under the SCSI device of the disk
+		dev = device_find_child(disk_to_dev(bdev->bd_disk)->parent, NULL, hddled_match_hwmon);
+		if (dev) {
+			strscpy(hwmon[i], dev_name(dev), sizeof(hwmon[i]));
+			put_device(dev);
+		}
+	}
+	mutex_unlock(&hddledBindLock);
+	if (!active) {
+		spin_lock_irqsave(&hddledLock, flags);
+		hddled_idle();
+		spin_unlock_irqrestore(&hddledLock, flags);
+		return;
+	}
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		temp[i] = INT_MIN;
+		if (!hwmon[i][0])
+			continue;
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/temp1_input", hwmon[i]);
+		if (hddled_read_sysfs(path, buf, sizeof(buf)) < 0 || kstrtoint(strim(buf), 10, &temp[i]) < 0)
+			temp[i] = INT_MIN;
+	}
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		if (led->trigger != HDDLED_TRIGGER_TEMP || led->empty || led->standby)
+			continue;
+		if (temp[i] != INT_MIN)
+			led->temp = temp[i];
+		hddled_show_temp(led);
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	schedule_delayed_work(&hddledTempWork, msecs_to_jiffies(max(1U, READ_ONCE(temp_interval)) * 1000));
+}
+
+// Caller holds hddledLock
+static void hddled_set_standby(struct hddled *led, bool standby) {
+	if (led->standby == standby)
+		return;
+	led->standby = standby;
+	if (!standby) {
+		// Pick up where the periodic work left off
+		hddled_reset_activity(led);
+		hddled_start_trigger(led);
+		hddled_kick_patterns();
+	}
+	hddled_render(led);
+	hddled_changed(led);
+}
+
+static unsigned long hddled_disk_ios(struct hddled *led) {
+	struct block_device *bdev = file_bdev(led->bdev_file);
+
+	return part_stat_read(bdev, ios[STAT_READ]) + part_stat_read(bdev, ios[STAT_WRITE]);
+}
+
+// Caller holds hddledLock, restarts idle tracking from the current disk counters
+static void hddled_reset_standby(struct hddled *led) {
+	hddled_set_standby(led, false);
+	led->last_io = jiffies;
+	if (led->bdev_file) {
+		led->standby_ios = hddled_disk_ios(led);
+		if (led->standby_timeout && !timer_pending(&hddledStandbyTimer)) {
+			hddled_wake();
+			mod_timer(&hddledStandbyTimer, jiffies + msecs_to_jiffies(HDDLED_STANDBY_CHECK_MS));
+		}
+	}
+}
+
+// Idle time comes from the block layer counters only, nothing is ever sent to the disk
+static void hddled_standby_tick(struct timer_list *t) {
+	unsigned long flags, ios;
+	struct hddled *led;
+	bool active = false;
+	int i;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		if (!led->standby_timeout || !led->bdev_file || led->empty)
+			continue;
+		active = true;
+		ios = hddled_disk_ios(led);
+		if (ios != led->standby_ios) {
+			led->standby_ios = ios;
+			led->last_io = jiffies;
+			hddled_set_standby(led, false);
+		} else if (time_after(jiffies, led->last_io + msecs_to_jiffies(led->standby_timeout * 1000))) {
+			hddled_set_standby(led, true);
+		}
+	}
+	if (active)
+		mod_timer(&hddledStandbyTimer, jiffies + msecs_to_jiffies(HDDLED_STANDBY_CHECK_MS));
+	else
+		hddled_idle();
+	spin_unlock_irqrestore(&hddledLock, flags);
+}
+
+// Caller holds hddledLock, true while any slot needs one of the timers or works
+static bool hddled_busy(void) {
+	struct hddled *led;
+	int i;
+
+	if (hddledAnim != HDDLED_ANIM_NONE)
+		return true;
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		if (led->trigger == HDDLED_TRIGGER_HEARTBEAT)
+			return true;
+		if (led->fault) {
+			if (READ_ONCE(fault_blink))
+				return true;
+			continue;
+		}
+		if (led->empty)
+			continue;
+		if (led->core.pattern_len && !led->standby)
+			return true;
+		if (led->bdev_file && (led->trigger != HDDLED_TRIGGER_NONE || led->standby_timeout))
+			return true;
+	}
+	return false;
+}
+
+// Caller holds hddledLock, rearms whatever the slots need, each stops again on its own
+// when it finds nothing to do
+static void hddled_restart_timers(void) {
+	int i;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		hddled_start_trigger(hddleds[i]);
+		if (hddleds[i]->bdev_file && hddleds[i]->standby_timeout && !timer_pending(&hddledStandbyTimer))
+			mod_timer(&hddledStandbyTimer, jiffies + msecs_to_jiffies(HDDLED_STANDBY_CHECK_MS));
+		if (hddledLimits[i].pending >= 0 && !timer_pending(&hddledCoalesceTimer))
+			mod_timer(&hddledCoalesceTimer, jiffies + 1);
+	}
+	hddled_kick_patterns();
+	if (hddledAnim != HDDLED_ANIM_NONE)
+		mod_timer(&hddledAnimTimer, jiffies + msecs_to_jiffies(HDDLED_TICK_MS));
+}
+
+static int hddled_suspend(struct device *dev) {
+	unsigned long flags;
+	int i;
+
+	if (dev != hddledCtlDevice)
+		return 0;
+
+	timer_delete_sync(&hddledPatternTimer);
+	timer_delete_sync(&hddledSampleTimer);
+	timer_delete_sync(&hddledStandbyTimer);
+	timer_delete_sync(&hddledAnimTimer);
+	timer_delete_sync(&hddledHeartbeatTimer);
+	// Held back writes stay pending and are applied after the snapshot on resume
+	timer_delete_sync(&hddledCoalesceTimer);
+	cancel_delayed_work_sync(&hddledMdWork);
+	cancel_delayed_work_sync(&hddledTempWork);
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		hddledSuspendStates[i] = hddled_get_state(hddleds[i]);
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return 0;
+}
+
+// Firmware may have reset the GPIOs, so the snapshot is written back in one batch before
+// anything else touches the pads
+static int hddled_resume(struct device *dev) {
+	unsigned long flags;
+	int i;
+
+	if (dev != hddledCtlDevice)
+		return 0;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		hddled_write_pads(hddleds[i], hddledSuspendStates[i]);
+	hddled_restart_timers();
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return 0;
+}
+
+// Refuses while a slot is dynamic, the pads keep their state either way
+static int hddled_runtime_suspend(struct device *dev) {
+	unsigned long flags;
+	bool busy;
+
+	if (dev != hddledCtlDevice)
+		return 0;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	busy = hddled_busy();
+	if (!busy) {
+		timer_delete(&hddledPatternTimer);
+		timer_delete(&hddledSampleTimer);
+		timer_delete(&hddledStandbyTimer);
+		timer_delete(&hddledHeartbeatTimer);
+		cancel_delayed_work(&hddledMdWork);
+		cancel_delayed_work(&hddledTempWork);
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return busy ? -EBUSY : 0;
+}
+
+static int hddled_runtime_resume(struct device *dev) {
+	unsigned long flags;
+
+	if (dev != hddledCtlDevice)
+		return 0;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_restart_timers();
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return 0;
+}
+
+// Caller holds hddledBindLock, takes over bdev_file which is NULL to unbind the slot
+static void hddled_bind_file(struct hddled *led, struct file *bdev_file) {
+	struct device *dev = hddledDevices[led->index];
+	struct file *old;
+	unsigned long flags;
+
+	if (led->bdev_file)
+		sysfs_remove_link(&dev->kobj, "block");
+
+	spin_lock_irqsave(&hddledLock, flags);
+	old = led->bdev_file;
+	led->bdev_file = bdev_file;
+	rcu_assign_pointer(led->disk, bdev_file ? file_bdev(bdev_file)->bd_disk : NULL);
+	hddled_reset_activity(led);
+	hddled_reset_standby(led);
+	hddled_start_trigger(led);
+	spin_unlock_irqrestore(&hddledLock, flags);
+
+	// Publish the mapping as /sys/class/hddled/hddledN/block
+	if (bdev_file && sysfs_create_link(&dev->kobj, &disk_to_dev(file_bdev(bdev_file)->bd_disk)->kobj, "block") < 0)
+		printk(KERN_WARNING "HDDLed: failed to link slot %d to its disk\n", led->index+1);
+
+	// The sampler only looks at the disk under hddledLock, so it is done with the old one,
+	// the error tracepoint may still be comparing against it until a grace period passed
+	if (old) {
+		synchronize_rcu();
+		fput(old);
+	}
+}
+
+// Caller holds hddledBindLock, an empty name unbinds the slot
+static int hddled_bind(struct hddled *led, const char *name) {
+	struct file *bdev_file = NULL;
+	char path[DISK_NAME_LEN + 6];
+
+	if (*name) {
+		if (strchr(name, '/') || strlen(name) >= DISK_NAME_LEN)
+			return -EINVAL;
+		snprintf(path, sizeof(path), "/dev/%s", name);
+		bdev_file = bdev_file_open_by_path(path, BLK_OPEN_READ, NULL, NULL);
+		if (IS_ERR(bdev_file))
+			return PTR_ERR(bdev_file);
+	}
+	hddled_bind_file(led, bdev_file);
+	return 0;
+}
+
+static int hddled_match_disk(struct device *dev, const void *data) {
+	return dev->class && !strcmp(dev->class->name, "block");
+}
+
+// Records the disk of every SCSI device on a bay port of the onboard AHCI controller
+static int hddled_scan_sdev(struct device *dev, void *data) {
+	dev_t *found = data;
+	struct scsi_device *sdev;
+	struct ata_port *ap;
+	struct pci_dev *pdev;
+	struct device *disk;
+	struct device *parent;
+	int i;
+
+	if (!scsi_is_sdev_device(dev))
+		return 0;
+	sdev = to_scsi_device(dev);
+
+	// libata hosts hang off the "ataN" port device
+	parent = sdev->host->shost_gendev.parent;
+	if (!parent || strncmp(dev_name(parent), "ata", 3) != 0)
+		return 0;
+	ap = ata_shost_to_port(sdev->host);
+	if (!ap->host->dev || !dev_is_pci(ap->host->dev))
+		return 0;
+	pdev = to_pci_dev(ap->host->dev);
+	if (pdev->bus->number != 0 || pdev->class != PCI_CLASS_STORAGE_SATA_AHCI)
+		return 0;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (hddledPorts[i] != ap->port_no)
+			continue;
+		disk = device_find_child(dev, NULL, hddled_match_disk);
+		if (disk) {
+			found[i] = disk->devt;
+			put_device(disk);
+		}
+	}
+	return 0;
+}
+
+// Caller holds hddledLock. A failing disk often drops off its link, so a latched fault
+// stays lit on the empty bay until it is cleared through the fault attribute
+static void hddled_set_empty(struct hddled *led, bool empty) {
+	if (led->empty == empty)
+		return;
+	led->empty = empty;
+	if (!empty && led->core.pattern_len)
+		hddled_kick_patterns();
+	hddled_render(led);
+	hddled_changed(led);
+}
+
+// Runs once per hotplug event instead of on every lookup
+static void hddled_rescan(struct work_struct *work) {
+	dev_t found[HDDLED_SLOTS] = { 0 };
+	struct file *bdev_file;
+	struct hddled *led;
+	unsigned long flags;
+	int i;
+
+	bus_for_each_dev(&scsi_bus_type, NULL, found, hddled_scan_sdev);
+
+	mutex_lock(&hddledBindLock);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		led = hddleds[i];
+		// Bays the board does not have are always empty. On an unknown board the port is only
+		// a guess, so a bay that finds nothing there is not held off
+		if (skip_empty && hddledPortsKnown[i]) {
+			spin_lock_irqsave(&hddledLock, flags);
+			hddled_set_empty(led, found[i] == 0);
+			spin_unlock_irqrestore(&hddledLock, flags);
+		}
+		if (hddledPorts[i] < 0)
+			continue;
+		if (led->bdev_file && file_bdev(led->bdev_file)->bd_dev == found[i])
+			continue;
+		if (!led->bdev_file && !found[i])
+			continue;
+
+		bdev_file = NULL;
+		if (found[i]) {
+			bdev_file = bdev_file_open_by_dev(found[i], BLK_OPEN_READ, NULL, NULL);
+			if (IS_ERR(bdev_file)) {
+				printk(KERN_WARNING "HDDLed: failed to open disk of slot %d (%ld)\n", i+1, PTR_ERR(bdev_file));
+				bdev_file = NULL;
+			}
+		}
+		hddled_bind_file(led, bdev_file);
+	}
+	mutex_unlock(&hddledBindLock);
+}
+
+// Disks appear once sd is bound to the SCSI device and are gone once it is unbound
+static int hddled_scsi_event(struct notifier_block *nb, unsigned long action, void *data) {
+	if (action == BUS_NOTIFY_BOUND_DRIVER || action == BUS_NOTIFY_UNBOUND_DRIVER)
+		schedule_work(&hddledRescanWork);
+	return NOTIFY_DONE;
+}
+
+static ssize_t disk_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+	ssize_t ret;
+
+	mutex_lock(&hddledBindLock);
+	if (led->bdev_file)
+		ret = sysfs_emit(buf, "%pg\n", file_bdev(led->bdev_file));
+	else
+		ret = sysfs_emit(buf, "\n");
+	mutex_unlock(&hddledBindLock);
+	return ret;
+}
+
+static ssize_t disk_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hddled *led = dev_get_drvdata(dev);
+	char name[DISK_NAME_LEN];
+	int err;
+
+	if (strscpy(name, buf, sizeof(name)) < 0)
+		return -EINVAL;
+	strim(name);
+	if (!strcmp(name, "none"))
+		name[0] = '\0';
+
+	mutex_lock(&hddledBindLock);
+	err = hddled_bind(led, name);
+	mutex_unlock(&hddledBindLock);
+	return err < 0 ? err : count;
+}
+static DEVICE_ATTR_RW(disk);
+
+static ssize_t trigger_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+	enum hddled_trigger current_trigger = READ_ONCE(led->trigger);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hddled_trigger_names); ++i) {
+		len += sysfs_emit_at(buf, len, i == current_trigger ? "[%s] " : "%s ", hddled_trigger_names[i]);
+	}
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t trigger_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hddled *led = dev_get_drvdata(dev);
+	unsigned long flags;
+	int trigger = sysfs_match_string(hddled_trigger_names, buf);
+
+	if (trigger < 0)
+		return trigger;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	if (led->trigger != trigger) {
+		led->trigger = trigger;
+		hddled_reset_activity(led);
+		if (trigger == HDDLED_TRIGGER_NONE) {
+			hddled_clear_layer(led, HDDLED_LAYER_ACTIVITY);
+		} else {
+			// Picking a trigger hands the slot back from whatever was last written to it
+			hddled_update_state(led, HDDLED_STATE_OFF);
+			hddled_clear_layer(led, HDDLED_LAYER_USER);
+			hddled_start_trigger(led);
+		}
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return count;
+}
+static DEVICE_ATTR_RW(trigger);
+
+static ssize_t fault_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", !!(atomic_read(&hddledFault) & BIT(led->index)));
+}
+
+// Only clearing is supported, latching is left to the block layer
+static ssize_t fault_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hddled *led = dev_get_drvdata(dev);
+	unsigned long flags;
+	bool val;
+	int err;
+
+	err = kstrtobool(buf, &val);
+	if (err < 0)
+		return err;
+	if (val)
+		return -EINVAL;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	atomic_andnot(BIT(led->index), &hddledFault);
+	if (led->fault) {
+		led->fault = false;
+		hddled_arbitrate(led);
+		hddled_render(led);
+		hddled_changed(led);
+	}
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return count;
+}
+static DEVICE_ATTR_RW(fault);
+
+static ssize_t locate_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(led->core.layers[HDDLED_LAYER_LOCATE].active));
+}
+
+// Blinks orange over anything but a fault until cleared
+static ssize_t locate_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hddled *led = dev_get_drvdata(dev);
+	unsigned long flags;
+	bool val;
+	int err;
+
+	err = kstrtobool(buf, &val);
+	if (err < 0)
+		return err;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	if (!val)
+		hddled_clear_layer(led, HDDLED_LAYER_LOCATE);
+	else if (hddled_store_layer(led, HDDLED_LAYER_LOCATE, HDDLED_STATE_BOTH,
+				    HDDLED_STATE_BOTH | (HDDLED_STATE_OFF << 2), 2, HDDLED_LOCATE_MS))
+		hddled_render(led);
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return count;
+}
+static DEVICE_ATTR_RW(locate);
+
+static ssize_t temperature_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(led->temp));
+}
+static DEVICE_ATTR_RO(temperature);
+
+#define HDDLED_TEMP_ATTR(_name)									\
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf) {	\
+	struct hddled *led = dev_get_drvdata(dev);						\
+												\
+	return sysfs_emit(buf, "%d\n", READ_ONCE(led->_name));					\
+}												\
+												\
+static ssize_t _name##_store(struct device *dev, struct device_attribute *attr,		\
+			     const char *buf, size_t count) {					\
+	struct hddled *led = dev_get_drvdata(dev);						\
+	unsigned long flags;									\
+	int val, err;										\
+												\
+	err = kstrtoint(buf, 10, &val);								\
+	if (err < 0)										\
+		return err;									\
+	spin_lock_irqsave(&hddledLock, flags);							\
+	led->_name = val;									\
+	if (led->trigger == HDDLED_TRIGGER_TEMP && led->temp && !led->empty)			\
+		hddled_show_temp(led);								\
+	spin_unlock_irqrestore(&hddledLock, flags);						\
+	return count;										\
+}												\
+static DEVICE_ATTR_RW(_name)
+
+HDDLED_TEMP_ATTR(temp_warn);
+HDDLED_TEMP_ATTR(temp_crit);
+HDDLED_TEMP_ATTR(temp_hyst);
+
+static ssize_t standby_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(led->standby));
+}
+static DEVICE_ATTR_RO(standby);
+
+static ssize_t standby_timeout_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(led->standby_timeout));
+}
+
+static ssize_t standby_timeout_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	struct hddled *led = dev_get_drvdata(dev);
+	unsigned long flags;
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 10, &val);
+	if (err < 0)
+		return err;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	led->standby_timeout = val;
+	hddled_reset_standby(led);
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return count;
+}
+static DEVICE_ATTR_RW(standby_timeout);
+
+static ssize_t writes_coalesced_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(hddledLimits[led->index].writes_coalesced));
+}
+static DEVICE_ATTR_RO(writes_coalesced);
+
+static ssize_t writes_dropped_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	struct hddled *led = dev_get_drvdata(dev);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(hddledLimits[led->index].writes_dropped));
+}
+static DEVICE_ATTR_RO(writes_dropped);
+
+static struct attribute *hddled_attrs[] = {
+	&dev_attr_disk.attr,
+	&dev_attr_trigger.attr,
+	&dev_attr_fault.attr,
+	&dev_attr_locate.attr,
+	&dev_attr_temperature.attr,
+	&dev_attr_temp_warn.attr,
+	&dev_attr_temp_crit.attr,
+	&dev_attr_temp_hyst.attr,
+	&dev_attr_standby.attr,
+	&dev_attr_standby_timeout.attr,
+	&dev_attr_writes_coalesced.attr,
+	&dev_attr_writes_dropped.attr,
+	NULL
+};
+
+static const struct attribute_group hddled_group = {
+	.attrs = hddled_attrs,
+};
+
+static ssize_t animation_show(struct device *dev, struct device_attribute *attr, char *buf) {
+	unsigned int current_anim = READ_ONCE(hddledAnim);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(hddled_anim_names); ++i) {
+		len += sysfs_emit_at(buf, len, i == current_anim ? "[%s] " : "%s ", hddled_anim_names[i]);
+	}
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t animation_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned long flags;
+	int err, anim = sysfs_match_string(hddled_anim_names, buf);
+
+	if (anim < 0)
+		return anim;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	err = hddled_start_anim(anim);
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return err < 0 ? err : count;
+}
+static DEVICE_ATTR_RW(animation);
+
+static ssize_t boot_done_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&hddledLock, flags);
+	hddled_end_boot();
+	spin_unlock_irqrestore(&hddledLock, flags);
+	return count;
+}
+static DEVICE_ATTR_WO(boot_done);
+
+static struct attribute *hddled_ctl_attrs[] = {
+	&dev_attr_animation.attr,
+	&dev_attr_boot_done.attr,
+	NULL
+};
+
+static const struct attribute_group hddled_ctl_group = {
+	.attrs = hddled_ctl_attrs,
+};
+
+static struct hddled* create_hddled(int index) {
+	struct hddled *led = kzalloc(sizeof(struct hddled), GFP_KERNEL);
+	if (!led)
+		return NULL;
+	led->index = index;
+	hddled_core_init(&led->core);
+	hddled_limit_init(&hddledLimits[index], jiffies, HZ);
+	led->temp_warn = 45;
+	led->temp_crit = 55;
+	led->temp_hyst = 3;
+	if (hddledBackend->map(led) < 0) {
+		hddledBackend->unmap(led);
+		kfree(led);
+		return NULL;
+	}
 	return led;
 }
 
@@ -0,0 +1,136 @@
+/*
+ * Userspace interface of the hddled_tmj33 module.
+ *
+ * Slots are numbered 1-5 like the /dev/hddled[1-5] char devices and states are the
+ * same values that can be written into them.
+ */
+
+#ifndef HDDLED_TMJ33_H
+#define HDDLED_TMJ33_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define HDDLED_SLOTS 5
+
+#define HDDLED_STATE_OFF   0
+#define HDDLED_STATE_GREEN 1
+#define HDDLED_STATE_RED   2
+#define HDDLED_STATE_BOTH  3
+
+// A pattern is up to 16 steps of 2 bit states, step 0 in the low bits
+#define HDDLED_PATTERN_MAX_STEPS 16
+
+// cmd_op values for IORING_OP_URING_CMD on /dev/hddled[1-5] and /dev/hddledctl
+#define HDDLED_URING_SET         1
+#define HDDLED_URING_GET         2
+#define HDDLED_URING_SET_PATTERN 3
+#define HDDLED_URING_SET_ALL     4
+
+// Payload in sqe->cmd, fits in a regular 64 byte SQE
+struct hddled_uring_cmd {
+	__u32 slot;      // 1-5, or 0 for the slot of the opened /dev/hddledN
+	__u32 state;     // SET: 0-3, SET_ALL: 2 bits per slot with slot 1 in the low bits
+	__u32 pattern;   // SET_PATTERN: 2 bits per step with step 0 in the low bits
+	__u16 step_ms;   // SET_PATTERN: duration of each step
+	__u8  steps;     // SET_PATTERN: number of steps, 0 stops the pattern
+	__u8  reserved;
+};
+
+// Staged transactions on /dev/hddledctl: BEGIN, any number of SET, then COMMIT applies
+// all of them in the same instant (or ABORT drops them)
+struct hddled_txn_set {
+	__u32 slot;      // 1-5
+	__u32 state;     // 0-3
+};
+
+#define HDDLED_IOC_MAGIC  'H'
+#define HDDLED_IOC_BEGIN  _IO(HDDLED_IOC_MAGIC, 1)
+#define HDDLED_IOC_SET    _IOW(HDDLED_IOC_MAGIC, 2, struct hddled_txn_set)
+#define HDDLED_IOC_COMMIT _IO(HDDLED_IOC_MAGIC, 3)
+#define HDDLED_IOC_ABORT  _IO(HDDLED_IOC_MAGIC, 4)
+
+// Enclosure animations drive every slot from a table of frames. A frame holds 2 bits per
+// slot with slot 1 in the low bits and is shown for ms milliseconds
+struct hddled_anim_frame {
+	__u16 states;
+	__u16 ms;
+};
+
+#define HDDLED_ANIM_MAX_FRAMES 64
+
+struct hddled_anim {
+	__u32 count;
+	struct hddled_anim_frame frames[HDDLED_ANIM_MAX_FRAMES];
+};
+
+#define HDDLED_ANIM_NONE     0
+#define HDDLED_ANIM_CHASE    1
+#define HDDLED_ANIM_SWEEP    2
+#define HDDLED_ANIM_IDENTIFY 3
+#define HDDLED_ANIM_CUSTOM   4
+#define HDDLED_ANIM_BOOT     5
+
+// Uploads the frames of HDDLED_ANIM_CUSTOM, then starts an animation by number
+#define HDDLED_IOC_ANIM_UPLOAD _IOW(HDDLED_IOC_MAGIC, 5, struct hddled_anim)
+#define HDDLED_IOC_ANIM_START  _IOW(HDDLED_IOC_MAGIC, 6, __u32)
+
+// Generic netlink family, the "state" multicast group gets a HDDLED_CMD_NOTIFY per change
+#define HDDLED_GENL_NAME    "hddled"
+#define HDDLED_GENL_VERSION 1
+#define HDDLED_GENL_MCGRP   "state"
+
+enum hddled_genl_cmd {
+	HDDLED_CMD_UNSPEC,
+	HDDLED_CMD_SET,      // SLOT and STATE, or STATES to set several slots at once
+	HDDLED_CMD_GET,      // SLOT, or a dump request for every slot
+	HDDLED_CMD_NOTIFY,   // Multicast only
+	__HDDLED_CMD_MAX,
+};
+#define HDDLED_CMD_MAX (__HDDLED_CMD_MAX - 1)
+
+enum hddled_genl_attr {
+	HDDLED_ATTR_UNSPEC,
+	HDDLED_ATTR_SLOT,    // u32, 1-5
+	HDDLED_ATTR_STATE,   // u32, 0-3
+	HDDLED_ATTR_STATES,  // binary, one byte per slot, 0xff leaves the slot unchanged
+	HDDLED_ATTR_PATTERN, // u32, only present while a pattern runs
+	__HDDLED_ATTR_MAX,
+};
+#define HDDLED_ATTR_MAX (__HDDLED_ATTR_MAX - 1)
+
+// Where the state a slot shows comes from, a higher source hides everything below it
+#define HDDLED_SOURCE_NONE     0
+#define HDDLED_SOURCE_ACTIVITY 1  // Trigger of the slot
+#define HDDLED_SOURCE_USER     2  // Writes from any interface or BPF
+#define HDDLED_SOURCE_LOCATE   3
+#define HDDLED_SOURCE_FAULT    4
+
+// Read from /dev/hddledstat, every read is a consistent snapshot of all slots
+#define HDDLED_STAT_VERSION 1
+
+struct hddled_stat_slot {
+	__u8  state;          // What the pads show
+	__u8  source;         // HDDLED_SOURCE_*
+	__u16 reserved;
+	__u32 changes;        // Number of times the pads changed
+	__u64 last_change_ns; // CLOCK_MONOTONIC time of the last change
+};
+
+struct hddled_stat {
+	__u32 version;        // HDDLED_STAT_VERSION, fields are only ever appended
+	__u32 size;           // sizeof(struct hddled_stat) of the module
+	__u64 generation;     // Bumped on every change of any slot
+	struct hddled_stat_slot slots[HDDLED_SLOTS];
+};
+
+// Read only page from mmap of /dev/hddledstat, updated on every change. seq is odd while
+// an update is in progress: load seq, copy stat, then load seq again and retry if it was
+// odd or has moved. Pollers can compare stat.generation to skip unchanged scrapes
+struct hddled_stat_page {
+	__u32 seq;
+	__u32 reserved;
+	struct hddled_stat stat;
+};
+
+#endif
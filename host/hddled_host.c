@@ -0,0 +1,110 @@
+/*
+ * Userspace build of the slot logic in hddled_core.h, see hddled_host.h.
+ */
+
+#include "hddled_host.h"
+
+static int hddled_stub_get(struct hddled_host *host, int slot) {
+	return host->pads[slot];
+}
+
+static void hddled_stub_set(struct hddled_host *host, int slot, int val) {
+	host->pads[slot] = val & 0x3;
+	++host->pad_writes;
+}
+
+const struct hddled_host_backend hddled_stub_backend = {
+	.name = "stub",
+	.get  = hddled_stub_get,
+	.set  = hddled_stub_set,
+};
+
+static struct hddled_core *hddled_host_core(void *ctx, int slot) {
+	return &((struct hddled_host *)ctx)->core[slot];
+}
+
+static bool hddled_host_fault(void *ctx, int slot) {
+	return ((struct hddled_host *)ctx)->fault[slot];
+}
+
+static void hddled_host_render(void *ctx, int slot) {
+	struct hddled_host *host = ctx;
+
+	if (host->fault[slot])
+		host->backend->set(host, slot, HDDLED_STATE_RED);
+	else
+		host->backend->set(host, slot, hddled_core_output(&host->core[slot]));
+}
+
+// The module's glue with its bookkeeping left out
+static const struct hddled_core_ops hddled_host_ops = {
+	.core   = hddled_host_core,
+	.fault  = hddled_host_fault,
+	.render = hddled_host_render,
+};
+
+void hddled_host_init(struct hddled_host *host, const struct hddled_host_backend *backend,
+		      unsigned int write_rate, unsigned long hz) {
+	int i;
+
+	*host = (struct hddled_host){
+		.backend    = backend,
+		.write_rate = write_rate,
+		.now        = hz,
+		.hz         = hz,
+	};
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		hddled_core_init(&host->core[i]);
+		hddled_limit_init(&host->limits[i], host->now, hz);
+		host->backend->set(host, i, HDDLED_STATE_OFF);
+	}
+}
+
+void hddled_host_set_layer(struct hddled_host *host, int slot, enum hddled_layer layer, int state,
+			   __u32 pattern, unsigned int steps, unsigned int step_ms) {
+	if (hddled_core_store(&hddled_host_ops, host, slot, layer, state, pattern, steps, step_ms))
+		hddled_host_render(host, slot);
+}
+
+void hddled_host_clear_layer(struct hddled_host *host, int slot, enum hddled_layer layer) {
+	hddled_core_clear(&hddled_host_ops, host, slot, layer);
+}
+
+void hddled_host_set_fault(struct hddled_host *host, int slot, bool fault) {
+	if (host->fault[slot] == fault)
+		return;
+	host->fault[slot] = fault;
+	hddled_core_update(&hddled_host_ops, host, slot);
+	hddled_host_render(host, slot);
+}
+
+void hddled_host_set_states(struct hddled_host *host, const int *states) {
+	hddled_core_set_states(&hddled_host_ops, host, states);
+}
+
+bool hddled_host_write(struct hddled_host *host, struct hddled_bucket *bucket, int *states) {
+	bool held = hddled_limit_hold(host->limits, bucket, states, host->write_rate, host->now, host->hz);
+
+	hddled_host_set_states(host, states);
+	return held;
+}
+
+bool hddled_host_flush(struct hddled_host *host) {
+	int states[HDDLED_SLOTS];
+
+	if (!hddled_limit_flush(host->limits, states, host->write_rate, host->now, host->hz))
+		return false;
+	hddled_host_set_states(host, states);
+	return true;
+}
+
+void hddled_host_tick(struct hddled_host *host) {
+	int i;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (host->fault[i])
+			continue;
+		if (hddled_core_tick(&host->core[i]))
+			hddled_host_render(host, i);
+	}
+}
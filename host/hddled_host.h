@@ -0,0 +1,56 @@
+/*
+ * Userspace build of the slot logic in hddled_core.h, for benchmarks and tests on any
+ * machine. It drives the same core the module uses, with the module's locking, timers and
+ * register backend replaced by a caller supplied clock and a backend vtable.
+ *
+ * Built into libhddled_core.a by `make bench-host`.
+ */
+
+#ifndef HDDLED_HOST_H
+#define HDDLED_HOST_H
+
+#include "hddled_core.h"
+
+struct hddled_host;
+
+// Same role as struct hddled_backend in the module, everything that would touch the pads
+struct hddled_host_backend {
+	const char *name;
+	int  (*get)(struct hddled_host *host, int slot);
+	void (*set)(struct hddled_host *host, int slot, int val);
+};
+
+// Backend that keeps the pads in memory and counts the writes that reached them
+extern const struct hddled_host_backend hddled_stub_backend;
+
+struct hddled_host {
+	const struct hddled_host_backend *backend;
+	struct hddled_core core[HDDLED_SLOTS];
+	bool fault[HDDLED_SLOTS];
+	struct hddled_limit limits[HDDLED_SLOTS];
+	unsigned int write_rate;        // Same as the module parameter, 0 for no limit
+	unsigned long now;              // Clock in ticks of hz, advanced by the caller
+	unsigned long hz;
+	// Stub backend state
+	int pads[HDDLED_SLOTS];
+	unsigned long pad_writes;
+};
+
+void hddled_host_init(struct hddled_host *host, const struct hddled_host_backend *backend,
+		      unsigned int write_rate, unsigned long hz);
+
+// Counterparts of the module functions of the same name
+void hddled_host_set_layer(struct hddled_host *host, int slot, enum hddled_layer layer, int state,
+			   __u32 pattern, unsigned int steps, unsigned int step_ms);
+void hddled_host_clear_layer(struct hddled_host *host, int slot, enum hddled_layer layer);
+void hddled_host_set_fault(struct hddled_host *host, int slot, bool fault);
+void hddled_host_set_states(struct hddled_host *host, const int *states);
+
+// A write from one open file through the rate limit, returns true when it was held back
+bool hddled_host_write(struct hddled_host *host, struct hddled_bucket *bucket, int *states);
+// What hddledCoalesceTimer does, returns false when it has to be retried later
+bool hddled_host_flush(struct hddled_host *host);
+// One hddledPatternTimer tick over every slot
+void hddled_host_tick(struct hddled_host *host);
+
+#endif
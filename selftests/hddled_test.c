@@ -0,0 +1,531 @@
+/*
+ * End-to-end test of a loaded hddled_tmj33 module, meant for sim=1 so it runs on any
+ * machine. `make check` loads the module, runs this and unloads it again.
+ *
+ * Writer processes hammer /dev/hddledN and /dev/hddledctl while reader processes check
+ * every snapshot they get from /dev/hddledN, /dev/hddledctl, /dev/hddledstat and its mapped
+ * page. Once they are done every interface has to report the same state, and then a known
+ * state written through the control device and the slot devices has to show up everywhere.
+ *
+ * The CPU time the processes spent is taken from /proc/<pid>/stat of each one before it is
+ * reaped and from inherited perf counters, and reported per operation. With -s the test
+ * fails when the system time per operation is above the given number of microseconds,
+ * which makes it usable as a gate for new builds.
+ *
+ * Output is TAP like the kernel selftests, the exit status is 0 on success, 1 on failure
+ * and 4 when the module is not loaded.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hddled_tmj33.h"
+
+#define KSFT_PASS 0
+#define KSFT_FAIL 1
+#define KSFT_SKIP 4
+
+#define MAX_PROCS 64
+
+// Filled in by each child in shared memory
+struct child_result {
+	unsigned long ops;
+	bool failed;
+	char msg[200];
+};
+
+struct child {
+	pid_t pid;
+	bool writer;
+	unsigned long utime, stime;     // Clock ticks from /proc/<pid>/stat
+};
+
+static int writers = 4, readers = 4;
+static double duration = 2.0;
+static double max_sys_us = 0;           // 0 only reports
+static struct child_result *results;
+static struct child children[MAX_PROCS];
+static int nchildren;
+static int test_nr;
+static bool any_failed;
+
+static void tap(bool ok, const char *fmt, ...) {
+	va_list ap;
+
+	printf("%sok %d - ", ok ? "" : "not ", ++test_nr);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	if (!ok)
+		any_failed = true;
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int next_rand(unsigned int *seed) {
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+static void fail(struct child_result *res, const char *fmt, ...) {
+	va_list ap;
+
+	if (res->failed)
+		return;
+	res->failed = true;
+	va_start(ap, fmt);
+	vsnprintf(res->msg, sizeof(res->msg), fmt, ap);
+	va_end(ap);
+}
+
+static const char *slot_dev(int slot) {
+	static char path[32];
+
+	snprintf(path, sizeof(path), "/dev/hddled%d", slot + 1);
+	return path;
+}
+
+// A fresh open per read, a slot device returns its value once per open
+static int read_slot_dev(int slot) {
+	char buf[4];
+	ssize_t n;
+	int fd;
+
+	fd = open(slot_dev(slot), O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (n != 1 || buf[0] < '0' || buf[0] > '3')
+		return -EINVAL;
+	return buf[0] - '0';
+}
+
+static int read_ctl(int fd, int *states) {
+	char buf[HDDLED_SLOTS * 2 + 1];
+	int i;
+
+	if (pread(fd, buf, sizeof(buf), 0) != HDDLED_SLOTS * 2)
+		return -1;
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		if (buf[i*2] < '0' || buf[i*2] > '3' || buf[i*2+1] != '\n')
+			return -1;
+		states[i] = buf[i*2] - '0';
+	}
+	return 0;
+}
+
+// Every read is a full snapshot from offset 0, pread keeps the file reusable
+static int read_stat(int fd, struct hddled_stat *stat) {
+	return pread(fd, stat, sizeof(*stat), 0) == sizeof(*stat) ? 0 : -1;
+}
+
+// The protocol from hddled_tmj33.h: seq is odd during an update and moves on every one
+static void read_page(const struct hddled_stat_page *page, struct hddled_stat *stat) {
+	__u32 seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(stat, (const void *)&page->stat, sizeof(*stat));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return;
+	}
+}
+
+// Checks one snapshot on its own and against the previous one from the same interface
+static void check_stat(struct child_result *res, const char *what, const struct hddled_stat *stat,
+		       struct hddled_stat *last) {
+	int i;
+
+	if (stat->version != HDDLED_STAT_VERSION || stat->size != sizeof(*stat))
+		fail(res, "%s: version %u size %u", what, stat->version, stat->size);
+	if (stat->generation < last->generation)
+		fail(res, "%s: generation went back from %llu to %llu", what,
+		     (unsigned long long)last->generation, (unsigned long long)stat->generation);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		const struct hddled_stat_slot *s = &stat->slots[i], *l = &last->slots[i];
+
+		if (s->state > HDDLED_STATE_BOTH || s->source > HDDLED_SOURCE_FAULT)
+			fail(res, "%s: slot %d state %u source %u", what, i + 1, s->state, s->source);
+		if (s->changes < l->changes || s->last_change_ns < l->last_change_ns)
+			fail(res, "%s: counters of slot %d went back", what, i + 1);
+	}
+	*last = *stat;
+}
+
+static void run_writer(struct child_result *res, unsigned int seed) {
+	int i, fds[HDDLED_SLOTS], ctl, states[HDDLED_SLOTS];
+	double end = now() + duration;
+	char buf[64];
+	size_t len;
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		fds[i] = open(slot_dev(i), O_WRONLY);
+		if (fds[i] < 0) {
+			fail(res, "open %s: %s", slot_dev(i), strerror(errno));
+			return;
+		}
+	}
+	ctl = open("/dev/hddledctl", O_WRONLY);
+	if (ctl < 0) {
+		fail(res, "open /dev/hddledctl: %s", strerror(errno));
+		return;
+	}
+
+	while (!res->failed && (res->ops & 63 || now() < end)) {
+		unsigned int r = next_rand(&seed), slot = r % HDDLED_SLOTS, state = (r >> 8) & 0x3;
+
+		switch ((r >> 16) % 4) {
+		case 0:
+			// Batch of every slot through the control device
+			len = 0;
+			for (i = 0; i < HDDLED_SLOTS; ++i) {
+				states[i] = next_rand(&seed) & 0x3;
+				len += snprintf(buf + len, sizeof(buf) - len, "%d %d\n", i + 1, states[i]);
+			}
+			if (write(ctl, buf, len) != (ssize_t)len)
+				fail(res, "batch write: %s", strerror(errno));
+			break;
+		case 1: {
+			// Two records as separate iovecs
+			char a[8], b[8];
+			struct iovec iov[2] = {
+				{ a, snprintf(a, sizeof(a), "%u %u", slot + 1, state) },
+				{ b, snprintf(b, sizeof(b), "%u %u", (slot + 1) % HDDLED_SLOTS + 1, state ^ 1) },
+			};
+
+			if (writev(ctl, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
+				fail(res, "writev: %s", strerror(errno));
+			break;
+		}
+		default:
+			len = snprintf(buf, sizeof(buf), "%u\n", state);
+			if (write(fds[slot], buf, len) != (ssize_t)len)
+				fail(res, "write %s: %s", slot_dev(slot), strerror(errno));
+			break;
+		}
+		++res->ops;
+	}
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		close(fds[i]);
+	close(ctl);
+}
+
+static void run_reader(struct child_result *res, unsigned int seed) {
+	struct hddled_stat stat, last_read = { 0 }, last_page = { 0 };
+	const struct hddled_stat_page *page;
+	double end = now() + duration;
+	int ctl, fd, state, states[HDDLED_SLOTS];
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	ctl = open("/dev/hddledctl", O_RDONLY);
+	fd = open("/dev/hddledstat", O_RDONLY);
+	if (ctl < 0 || fd < 0) {
+		fail(res, "open: %s", strerror(errno));
+		return;
+	}
+	page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		fail(res, "mmap /dev/hddledstat: %s", strerror(errno));
+		return;
+	}
+
+	while (!res->failed && (res->ops & 63 || now() < end)) {
+		unsigned int r = next_rand(&seed);
+
+		switch (r % 4) {
+		case 0:
+			if (read_stat(fd, &stat) < 0)
+				fail(res, "read /dev/hddledstat: %s", strerror(errno));
+			else
+				check_stat(res, "/dev/hddledstat", &stat, &last_read);
+			break;
+		case 1:
+			read_page(page, &stat);
+			check_stat(res, "mapped page", &stat, &last_page);
+			break;
+		case 2:
+			if (read_ctl(ctl, states) < 0)
+				fail(res, "bad read from /dev/hddledctl");
+			break;
+		default:
+			state = read_slot_dev((r >> 8) % HDDLED_SLOTS);
+			if (state < 0)
+				fail(res, "bad read from a slot device: %s", strerror(-state));
+			break;
+		}
+		++res->ops;
+	}
+	munmap((void *)page, page_size);
+	close(fd);
+	close(ctl);
+}
+
+static int perf_open(__u32 type, __u64 config, bool kernel_only) {
+	struct perf_event_attr attr = {
+		.size = sizeof(attr),
+		.type = type,
+		.config = config,
+		.disabled = 1,
+		.inherit = 1,
+		.exclude_user = kernel_only,
+		.exclude_hv = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static unsigned long long perf_read(int fd) {
+	unsigned long long val = 0;
+
+	if (fd < 0 || read(fd, &val, sizeof(val)) != sizeof(val))
+		return 0;
+	return val;
+}
+
+// utime and stime of a child that exited but was not reaped yet
+static int proc_times(pid_t pid, unsigned long *utime, unsigned long *stime) {
+	char path[32], buf[512], *p;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return -1;
+	buf[n] = '\0';
+	// The command name may contain anything, the fields start after its last ')'
+	p = strrchr(buf, ')');
+	if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", utime, stime) != 2)
+		return -1;
+	return 0;
+}
+
+static bool read_all(int ctl, int stat_fd, const struct hddled_stat_page *page, const int *expect) {
+	struct hddled_stat stat, mapped;
+	int i, dev, states[HDDLED_SLOTS];
+	bool ok = true;
+
+	if (read_ctl(ctl, states) < 0 || read_stat(stat_fd, &stat) < 0) {
+		printf("# reading the control or status device failed\n");
+		return false;
+	}
+	read_page(page, &mapped);
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		int want = expect ? expect[i] : states[i];
+
+		dev = read_slot_dev(i);
+		if (dev != want || states[i] != want || stat.slots[i].state != want ||
+		    mapped.slots[i].state != want || stat.slots[i].source != HDDLED_SOURCE_USER) {
+			printf("# slot %d: want %d, %s %d, ctl %d, stat %u (source %u), page %u\n", i + 1, want,
+			       slot_dev(i), dev, states[i], stat.slots[i].state, stat.slots[i].source,
+			       mapped.slots[i].state);
+			ok = false;
+		}
+	}
+	if (stat.generation != mapped.generation) {
+		printf("# generation %llu from read, %llu from the page\n",
+		       (unsigned long long)stat.generation, (unsigned long long)mapped.generation);
+		ok = false;
+	}
+	return ok;
+}
+
+static unsigned int read_write_rate(void) {
+	unsigned int rate = 0;
+	FILE *f = fopen("/sys/module/hddled_tmj33/parameters/write_rate", "r");
+
+	if (f) {
+		if (fscanf(f, "%u", &rate) != 1)
+			rate = 0;
+		fclose(f);
+	}
+	return rate;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-w writers] [-r readers] [-t seconds] [-s max system us per op]\n", prog);
+	exit(KSFT_FAIL);
+}
+
+int main(int argc, char **argv) {
+	static const int final_ctl[HDDLED_SLOTS] = { 1, 2, 3, 0, 1 };
+	static const int final_dev[HDDLED_SLOTS] = { 3, 0, 1, 2, 3 };
+	unsigned long ops[2] = { 0 }, ticks[2] = { 0 }, utime = 0, stime = 0;
+	int i, opt, ctl, stat_fd, perf_clock, perf_kinsn;
+	unsigned long long task_ns, kernel_insns;
+	const struct hddled_stat_page *page;
+	long hz = sysconf(_SC_CLK_TCK);
+	bool children_ok = true;
+	double start, elapsed, sys_us;
+	char buf[64];
+	size_t len;
+
+	while ((opt = getopt(argc, argv, "w:r:t:s:")) != -1) {
+		switch (opt) {
+		case 'w': writers = atoi(optarg); break;
+		case 'r': readers = atoi(optarg); break;
+		case 't': duration = atof(optarg); break;
+		case 's': max_sys_us = atof(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (writers < 1 || readers < 0 || writers + readers > MAX_PROCS || duration <= 0)
+		usage(argv[0]);
+
+	printf("TAP version 13\n");
+	if (access("/dev/hddledctl", F_OK) < 0) {
+		printf("1..0 # SKIP hddled_tmj33 is not loaded\n");
+		return KSFT_SKIP;
+	}
+	printf("1..5\n");
+
+	ctl = open("/dev/hddledctl", O_RDWR);
+	stat_fd = open("/dev/hddledstat", O_RDONLY);
+	if (ctl < 0 || stat_fd < 0) {
+		printf("Bail out! cannot open the control devices: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+	page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, stat_fd, 0);
+	results = mmap(NULL, sizeof(*results) * MAX_PROCS, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (page == MAP_FAILED || results == MAP_FAILED) {
+		printf("Bail out! mmap: %s\n", strerror(errno));
+		return KSFT_FAIL;
+	}
+
+	// Counted over every child, inherited counters are folded in as the children exit
+	perf_clock = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, false);
+	perf_kinsn = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true);
+	if (perf_clock >= 0)
+		ioctl(perf_clock, PERF_EVENT_IOC_ENABLE, 0);
+	if (perf_kinsn >= 0)
+		ioctl(perf_kinsn, PERF_EVENT_IOC_ENABLE, 0);
+
+	start = now();
+	for (i = 0; i < writers + readers; ++i) {
+		struct child *c = &children[nchildren];
+
+		c->writer = i < writers;
+		c->pid = fork();
+		if (c->pid < 0) {
+			printf("Bail out! fork: %s\n", strerror(errno));
+			return KSFT_FAIL;
+		}
+		if (c->pid == 0) {
+			if (c->writer)
+				run_writer(&results[i], 0x9e3779b9u * (i + 1));
+			else
+				run_reader(&results[i], 0x85ebca6bu * (i + 1));
+			_exit(results[i].failed);
+		}
+		++nchildren;
+	}
+
+	for (i = 0; i < nchildren; ++i) {
+		struct child *c = &children[i];
+		siginfo_t info;
+		int status;
+
+		// Look at the zombie first, its times are gone once it is reaped
+		if (waitid(P_PID, c->pid, &info, WEXITED | WNOWAIT) == 0 &&
+		    proc_times(c->pid, &c->utime, &c->stime) == 0) {
+			utime += c->utime;
+			stime += c->stime;
+			ticks[c->writer] += c->utime + c->stime;
+		}
+		waitpid(c->pid, &status, 0);
+		ops[c->writer] += results[i].ops;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) || results[i].failed) {
+			printf("# %s %d: %s\n", c->writer ? "writer" : "reader", c->pid,
+			       results[i].msg[0] ? results[i].msg : "died");
+			children_ok = false;
+		}
+	}
+	elapsed = now() - start;
+	task_ns = perf_read(perf_clock);
+	kernel_insns = perf_read(perf_kinsn);
+
+	tap(children_ok, "%d writers and %d readers for %.1f s", writers, readers, duration);
+
+	// Held back writes need a moment to drain before the interfaces can agree
+	if (read_write_rate())
+		sleep(2);
+	tap(read_all(ctl, stat_fd, page, NULL), "every interface reports the same state after the run");
+
+	len = 0;
+	for (i = 0; i < HDDLED_SLOTS; ++i)
+		len += snprintf(buf + len, sizeof(buf) - len, "%d %d\n", i + 1, final_ctl[i]);
+	if (write(ctl, buf, len) != (ssize_t)len)
+		printf("# final batch write: %s\n", strerror(errno));
+	if (read_write_rate())
+		sleep(2);
+	tap(read_all(ctl, stat_fd, page, final_ctl), "batch written to /dev/hddledctl shows everywhere");
+
+	for (i = 0; i < HDDLED_SLOTS; ++i) {
+		int fd = open(slot_dev(i), O_WRONLY);
+
+		len = snprintf(buf, sizeof(buf), "%d\n", final_dev[i]);
+		if (fd < 0 || write(fd, buf, len) != (ssize_t)len)
+			printf("# final write to %s: %s\n", slot_dev(i), strerror(errno));
+		if (fd >= 0)
+			close(fd);
+	}
+	if (read_write_rate())
+		sleep(2);
+	tap(read_all(ctl, stat_fd, page, final_dev), "writes to /dev/hddledN show everywhere");
+
+	printf("# %lu writes (%.0f/s), %lu reads (%.0f/s) in %.2f s\n", ops[1], ops[1] / elapsed,
+	       ops[0], ops[0] / elapsed, elapsed);
+	printf("# /proc: user %.3f s, system %.3f s; writers %.3f s, readers %.3f s\n",
+	       (double)utime / hz, (double)stime / hz, (double)ticks[1] / hz, (double)ticks[0] / hz);
+	if (perf_clock >= 0)
+		printf("# perf: task-clock %.3f s, %.2f us per operation\n", task_ns / 1e9,
+		       task_ns / 1e3 / (ops[0] + ops[1]));
+	else
+		printf("# perf: task-clock not available\n");
+	if (perf_kinsn >= 0 && kernel_insns)
+		printf("# perf: %.0f kernel instructions per operation\n",
+		       (double)kernel_insns / (ops[0] + ops[1]));
+	else
+		printf("# perf: kernel instruction counter not available\n");
+
+	sys_us = (double)stime / hz * 1e6 / (ops[0] + ops[1]);
+	if (max_sys_us > 0)
+		tap(sys_us <= max_sys_us, "%.2f us of system time per operation, limit %.2f", sys_us, max_sys_us);
+	else
+		printf("ok %d - %.2f us of system time per operation # SKIP no limit given with -s\n",
+		       ++test_nr, sys_us);
+
+	return any_failed ? KSFT_FAIL : KSFT_PASS;
+}